@@ -4,10 +4,35 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <signal.h>
 #include <cstring>
 #include <cmath>
 #include <sstream>
 #include <iomanip>
+#include <map>
+#include <list>
+#include <unordered_map>
+#include <deque>
+#include <algorithm>
+#include <climits>
+#include <cerrno>
+#include <cstdint>
+#include <ctime>
+#include <sched.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <zlib.h>
+#include <linux/perf_event.h>
 
 using namespace std;
 
@@ -23,6 +48,200 @@ struct NeuronData {
 pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
 vector<double> layer_outputs;
 
+// ============================================================================
+// Hardware performance counters (--perf)
+// ============================================================================
+
+enum CounterId {
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_LLC_MISSES,
+    COUNTER_DTLB_MISSES,
+    COUNTER_CONTEXT_SWITCHES,
+    NUM_COUNTERS
+};
+
+const char* COUNTER_NAMES[NUM_COUNTERS] = {
+    "cycles", "instructions", "LLC misses", "dTLB misses", "context switches"
+};
+
+// Open perf_event descriptors of the calling thread (or process with inherit)
+struct PerfCounters {
+    int fds[NUM_COUNTERS];
+};
+
+// Compute threads of a layer process (--threads) with their own counter slot
+const int MAX_COUNTED_THREADS = 16;
+
+// Counts of one compute thread of a layer process
+struct ThreadCounters {
+    uint64_t values[NUM_COUNTERS];
+    bool available[NUM_COUNTERS];
+};
+
+// Counter totals of one layer process, written into shared memory so the
+// dispatcher can print a per-layer report after the run. Slot 0 of
+// per_thread is the layer process itself, the others its worker threads.
+struct LayerCounters {
+    uint64_t values[NUM_COUNTERS];
+    bool available[NUM_COUNTERS];
+    uint64_t samples;
+    uint64_t flops;
+    uint64_t weight_bytes;
+    int threads;
+    ThreadCounters per_thread[MAX_COUNTED_THREADS];
+};
+
+bool collect_counters = false;
+LayerCounters* layer_counters = NULL;
+
+// Open all counters; events the CPU, kernel or container does not expose are
+// left at -1 and reported as n/a
+void perfOpen(PerfCounters& counters, bool inherit) {
+    uint32_t types[NUM_COUNTERS] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+        PERF_TYPE_HW_CACHE, PERF_TYPE_SOFTWARE
+    };
+    uint64_t configs[NUM_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_SW_CONTEXT_SWITCHES
+    };
+
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[i];
+        attr.config = configs[i];
+        attr.inherit = inherit ? 1 : 0;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        // Context switches happen in the kernel, so only exclude kernel mode
+        // for them when the paranoid level demands it
+        attr.exclude_kernel = (types[i] == PERF_TYPE_SOFTWARE) ? 0 : 1;
+        counters.fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (counters.fds[i] < 0 && !attr.exclude_kernel) {
+            attr.exclude_kernel = 1;
+            counters.fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+    }
+}
+
+// Read and close the counters. Values are scaled up when the kernel had to
+// multiplex more events than the PMU has registers.
+void perfClose(PerfCounters& counters, uint64_t* values, bool* available) {
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        values[i] = 0;
+        available[i] = false;
+        if (counters.fds[i] < 0) continue;
+        uint64_t data[3];
+        if (read(counters.fds[i], data, sizeof(data)) == (ssize_t)sizeof(data)) {
+            values[i] = data[2] > 0 ? (uint64_t)((double)data[0] * data[1] / data[2]) : 0;
+            available[i] = true;
+        }
+        close(counters.fds[i]);
+        counters.fds[i] = -1;
+    }
+}
+
+// Map zeroed counter slots shared with forked layer processes
+LayerCounters* allocCounters(int slots) {
+    void* mem = mmap(NULL, slots * sizeof(LayerCounters), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    return mem == MAP_FAILED ? NULL : (LayerCounters*)mem;
+}
+
+string counterValue(const LayerCounters& counters, int id) {
+    if (!counters.available[id]) return "n/a";
+    stringstream ss;
+    ss << counters.values[id];
+    return ss.str();
+}
+
+// Instructions per cycle, or n/a when either counter is missing
+string ipcValue(const uint64_t* values, const bool* available) {
+    if (!available[COUNTER_CYCLES] || !available[COUNTER_INSTRUCTIONS] ||
+        values[COUNTER_CYCLES] == 0) {
+        return "n/a";
+    }
+    stringstream ss;
+    ss << fixed << setprecision(2) << (double)values[COUNTER_INSTRUCTIONS] / values[COUNTER_CYCLES];
+    return ss.str();
+}
+
+// Per-layer report: raw counts plus IPC and DRAM bytes (LLC misses * 64) per
+// FLOP, and with --threads a line per compute thread
+void reportLayerCounters(const LayerCounters* slots, int replicas, int layers, int first_layer) {
+    cout << "\nPerformance counters per layer (all replicas):" << endl;
+    bool any_missing = false;
+    for (int l = 0; l < layers; l++) {
+        LayerCounters total;
+        memset(&total, 0, sizeof(total));
+        for (int i = 0; i < NUM_COUNTERS; i++) {
+            total.available[i] = true;
+        }
+        for (int r = 0; r < replicas; r++) {
+            const LayerCounters& slot = slots[r * layers + l];
+            for (int i = 0; i < NUM_COUNTERS; i++) {
+                total.values[i] += slot.values[i];
+                total.available[i] = total.available[i] && slot.available[i];
+            }
+            total.samples += slot.samples;
+            total.flops += slot.flops;
+            total.weight_bytes = slot.weight_bytes;
+        }
+
+        cout << "  Layer " << first_layer + l << ": " << total.samples << " samples, "
+             << total.flops << " FLOPs, weights " << total.weight_bytes / 1024 << " KB" << endl;
+        cout << "   ";
+        for (int i = 0; i < NUM_COUNTERS; i++) {
+            cout << " " << COUNTER_NAMES[i] << "=" << counterValue(total, i);
+            any_missing = any_missing || !total.available[i];
+        }
+        cout << endl;
+        cout << "    IPC: " << ipcValue(total.values, total.available);
+        cout << "  bytes/FLOP: ";
+        if (total.available[COUNTER_LLC_MISSES] && total.flops > 0) {
+            cout << fixed << setprecision(4)
+                 << 64.0 * total.values[COUNTER_LLC_MISSES] / total.flops;
+        } else {
+            cout << "n/a";
+        }
+        cout << endl;
+
+        int threads = min(slots[l].threads, MAX_COUNTED_THREADS);
+        for (int t = 0; threads > 1 && t < threads; t++) {
+            ThreadCounters sum;
+            memset(&sum, 0, sizeof(sum));
+            for (int i = 0; i < NUM_COUNTERS; i++) {
+                sum.available[i] = true;
+            }
+            for (int r = 0; r < replicas; r++) {
+                const ThreadCounters& slot = slots[r * layers + l].per_thread[t];
+                for (int i = 0; i < NUM_COUNTERS; i++) {
+                    sum.values[i] += slot.values[i];
+                    sum.available[i] = sum.available[i] && slot.available[i];
+                }
+            }
+            cout << "    thread " << t << (t == 0 ? " (layer process)" : "") << ":";
+            for (int i = 0; i < NUM_COUNTERS; i++) {
+                cout << " " << COUNTER_NAMES[i] << "="
+                     << (sum.available[i] ? to_string(sum.values[i]) : "n/a");
+            }
+            cout << "  IPC: " << ipcValue(sum.values, sum.available) << endl;
+        }
+    }
+    if (any_missing) {
+        cout << "  (n/a: event not exposed by this CPU/VM or blocked by "
+                "/proc/sys/kernel/perf_event_paranoid)" << endl;
+    }
+}
+
 // Thread function for neuron computation
 void* neuron_compute(void* arg) {
     NeuronData* data = (NeuronData*)arg;
@@ -236,10 +455,3388 @@ void displayBackwardProp(int layer_num, const vector<double>& values) {
     cout << endl;
 }
 
-int main() {
-    string filename = "input.txt";
-    int num_hidden_layers;
-    int neurons_per_layer;
+// ============================================================================
+// Huge page backed buffers (--hugepages on|off)
+// ============================================================================
+
+const size_t HUGE_PAGE_BYTES = 2 << 20;
+// Smaller buffers would waste most of a 2 MB page after rounding up
+const size_t HUGE_PAGE_MIN_BYTES = 1 << 20;
+
+enum PageBacking {
+    BACKING_HUGETLB,
+    BACKING_THP,
+    BACKING_NOHUGE,
+    BACKING_SMALL
+};
+
+// Record of one large allocation, used by the page usage report
+struct LargeBuffer {
+    void* ptr;
+    size_t bytes;
+    PageBacking backing;
+    string name;
+};
+
+// Huge pages are requested unless disabled with --hugepages off
+bool use_hugepages = true;
+vector<LargeBuffer> large_buffers;
+// Set while the first replica run starts; its layer processes then report
+// their activation buffers once they are sized
+bool report_activation_pages = false;
+
+const char* backingName(PageBacking backing) {
+    switch (backing) {
+        case BACKING_HUGETLB: return "hugetlb 2MB";
+        case BACKING_THP: return "THP (madvise)";
+        case BACKING_NOHUGE: return "4KB (nohuge)";
+        default: return "4KB pages";
+    }
+}
+
+// Map bytes aligned to a 2 MB boundary so transparent huge pages can back it
+void* mapAligned(size_t bytes, int flags) {
+    size_t padded = bytes + HUGE_PAGE_BYTES;
+    char* raw = (char*)mmap(NULL, padded, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (raw == MAP_FAILED) return MAP_FAILED;
+    char* aligned = (char*)(((uintptr_t)raw + HUGE_PAGE_BYTES - 1) & ~(uintptr_t)(HUGE_PAGE_BYTES - 1));
+    if (aligned > raw) munmap(raw, aligned - raw);
+    size_t tail = (raw + padded) - (aligned + bytes);
+    if (tail > 0) munmap(aligned + bytes, tail);
+    return aligned;
+}
+
+// Allocate a weight or activation buffer. With huge pages enabled this tries
+// MAP_HUGETLB first, then 2 MB aligned memory with MADV_HUGEPAGE, and falls
+// back to regular pages. With huge pages disabled the buffer is marked
+// MADV_NOHUGEPAGE so THP in "always" mode does not back it with 2 MB pages
+// anyway. Shared buffers stay visible to forked layer processes.
+void* allocLarge(size_t bytes, bool shared, const string& name) {
+    int flags = (shared ? MAP_SHARED : MAP_PRIVATE) | MAP_ANONYMOUS;
+    LargeBuffer buffer;
+    buffer.name = name;
+    buffer.ptr = MAP_FAILED;
+    buffer.backing = BACKING_SMALL;
+    buffer.bytes = bytes;
+
+    if (use_hugepages && bytes >= HUGE_PAGE_MIN_BYTES) {
+        size_t rounded = (bytes + HUGE_PAGE_BYTES - 1) & ~(HUGE_PAGE_BYTES - 1);
+        buffer.ptr = mmap(NULL, rounded, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+        if (buffer.ptr != MAP_FAILED) {
+            buffer.bytes = rounded;
+            buffer.backing = BACKING_HUGETLB;
+        } else {
+            buffer.ptr = mapAligned(rounded, flags);
+            if (buffer.ptr != MAP_FAILED) {
+                buffer.bytes = rounded;
+                buffer.backing = madvise(buffer.ptr, rounded, MADV_HUGEPAGE) == 0 ? BACKING_THP
+                                                                                 : BACKING_SMALL;
+            }
+        }
+    }
+    if (buffer.ptr == MAP_FAILED) {
+        buffer.ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (buffer.ptr == MAP_FAILED) return NULL;
+        buffer.bytes = bytes;
+        if (!use_hugepages && madvise(buffer.ptr, bytes, MADV_NOHUGEPAGE) == 0) {
+            buffer.backing = BACKING_NOHUGE;
+        }
+    }
+
+    large_buffers.push_back(buffer);
+    return buffer.ptr;
+}
+
+void freeLarge(void* ptr) {
+    for (size_t i = 0; i < large_buffers.size(); i++) {
+        if (large_buffers[i].ptr == ptr) {
+            munmap(ptr, large_buffers[i].bytes);
+            large_buffers.erase(large_buffers.begin() + i);
+            return;
+        }
+    }
+}
+
+// Report the page size actually backing every large buffer, read from
+// /proc/self/smaps (THP is only a hint, so the kernel may still use 4 KB pages).
+// owner names the reporting process; the report is written in one piece so
+// reports of concurrent layer processes do not interleave.
+void reportPageUsage(const string& owner) {
+    ostringstream report;
+    report << "Page usage" << (owner.empty() ? "" : " of " + owner)
+           << " (huge pages " << (use_hugepages ? "on" : "off") << "):" << endl;
+    for (const LargeBuffer& buffer : large_buffers) {
+        long kernel_page_kb = 0;
+        long huge_kb = 0;
+        ifstream smaps("/proc/self/smaps");
+        string line;
+        bool in_mapping = false;
+        while (getline(smaps, line)) {
+            unsigned long start, end;
+            if (sscanf(line.c_str(), "%lx-%lx ", &start, &end) == 2 && line.find(':') > line.find(' ')) {
+                in_mapping = (void*)start <= buffer.ptr && buffer.ptr < (void*)end;
+                continue;
+            }
+            if (!in_mapping) continue;
+            long kb;
+            if (sscanf(line.c_str(), "KernelPageSize: %ld", &kb) == 1) kernel_page_kb = kb;
+            if (sscanf(line.c_str(), "AnonHugePages: %ld", &kb) == 1) huge_kb += kb;
+            if (sscanf(line.c_str(), "ShmemPmdMapped: %ld", &kb) == 1) huge_kb += kb;
+            if (sscanf(line.c_str(), "Shared_Hugetlb: %ld", &kb) == 1) huge_kb += kb;
+            if (sscanf(line.c_str(), "Private_Hugetlb: %ld", &kb) == 1) huge_kb += kb;
+        }
+        report << "  " << left << setw(22) << buffer.name << right
+               << setw(10) << buffer.bytes / 1024 << " KB  requested: " << setw(13)
+               << backingName(buffer.backing) << "  kernel page: " << kernel_page_kb
+               << " KB  on 2MB pages: " << huge_kb << " KB" << endl;
+    }
+    cout << report.str() << flush;
+}
+
+// Activation buffer of a layer process, grown on demand from allocLarge
+struct ActivationBuffer {
+    double* data;
+    size_t capacity;
+    string name;
+};
+
+bool reserveActivations(ActivationBuffer& buffer, size_t count) {
+    if (count <= buffer.capacity) return true;
+    if (buffer.data) freeLarge(buffer.data);
+    buffer.data = (double*)allocLarge(count * sizeof(double), false, buffer.name);
+    buffer.capacity = buffer.data ? count : 0;
+    return buffer.data != NULL;
+}
+
+void releaseActivations(ActivationBuffer& buffer) {
+    if (buffer.data) freeLarge(buffer.data);
+    buffer.data = NULL;
+    buffer.capacity = 0;
+}
+
+// ============================================================================
+// Replica pipeline mode (--replicas N)
+// ============================================================================
+
+// Per-layer compute and transport parameters, set on the command line or
+// loaded from an autotune profile
+struct LayerTuning {
+    int threads;
+    int tile_rows;
+    int tile_cols;
+    bool unix_socket;
+};
+
+// Command line options for the non-interactive modes
+struct RunOptions {
+    int hidden_layers;
+    int neurons;
+    int replicas;
+    long samples;
+    int window;
+    bool least_loaded;
+    string input_file;
+    string output_file;
+    bool binary_output;
+    bool bench_hugepages;
+    int batch;
+    string config_file;
+    int stage;
+    bool distributed;
+    bool spawn_local;
+    LayerTuning tuning;
+    string transport;
+    bool autotune;
+    string profile_file;
+    string graph_file;
+    long cache_entries;
+    int cache_shards;
+};
+
+// Header sent in front of every activation frame. payload_bytes is 0 for raw
+// doubles, otherwise the size of the compressed payload that follows. Frames
+// cross hosts, so header fields and payload doubles are little-endian on the
+// wire regardless of the host byte order.
+struct FrameHeader {
+    int64_t seq;
+    int32_t count;
+    int32_t dim;
+    uint32_t payload_bytes;
+    uint32_t reserved;
+};
+
+// Upper bound on samples per frame (--batch), so a corrupt or hostile header
+// cannot make a receiver allocate an arbitrary amount of memory
+const int MAX_FRAME_SAMPLES = 1 << 16;
+
+// Frame transport over a pipe or socket. Sends are appended to a buffer and
+// written once flush_bytes is reached (0 writes every frame through), and
+// payloads can be byte-shuffled and deflated.
+struct FrameLink {
+    int fd;
+    bool compress;
+    size_t flush_bytes;
+    string pending;
+    vector<unsigned char> shuffled;
+    vector<unsigned char> packed;
+    long frames;
+    long raw_bytes;
+    long wire_bytes;
+    long sends;
+};
+
+// Flattened weight matrix of one layer inside the shared weight region
+struct LayerShape {
+    int rows;
+    int cols;
+    size_t offset;
+};
+
+// One read-only copy of all layer weights, shared by every replica
+struct SharedWeights {
+    double* base;
+    size_t bytes;
+    vector<LayerShape> layers;
+};
+
+// One replica of the layer-process chain as seen by the dispatcher
+struct Replica {
+    vector<pid_t> pids;
+    FrameLink in;
+    FrameLink out;
+    int inflight;
+};
+
+// Write exactly n bytes, retrying on short writes
+bool writeFull(int fd, const void* buf, size_t n) {
+    const char* p = (const char*)buf;
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        p += w;
+        n -= w;
+    }
+    return true;
+}
+
+// Read exactly n bytes, returns false on EOF or error
+bool readFull(int fd, void* buf, size_t n) {
+    char* p = (char*)buf;
+    while (n > 0) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+void linkInit(FrameLink& link, int fd, bool compress, size_t flush_bytes) {
+    link.fd = fd;
+    link.compress = compress;
+    link.flush_bytes = flush_bytes;
+    link.pending.clear();
+    link.frames = 0;
+    link.raw_bytes = 0;
+    link.wire_bytes = 0;
+    link.sends = 0;
+}
+
+// Write out everything buffered on the link
+bool linkFlush(FrameLink& link) {
+    if (link.pending.empty()) return true;
+    bool ok = writeFull(link.fd, link.pending.data(), link.pending.size());
+    link.sends++;
+    link.pending.clear();
+    return ok;
+}
+
+// Position of little-endian byte b inside a double in host byte order
+inline size_t hostByte(size_t b) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return sizeof(double) - 1 - b;
+#else
+    return b;
+#endif
+}
+
+// Convert doubles between host and wire (little-endian) byte order in place;
+// a no-op on little-endian hosts
+void swapWireDoubles(char* bytes, size_t count) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    for (size_t i = 0; i < count; i++) {
+        uint64_t word;
+        memcpy(&word, bytes + i * sizeof(word), sizeof(word));
+        word = __builtin_bswap64(word);
+        memcpy(bytes + i * sizeof(word), &word, sizeof(word));
+    }
+#else
+    (void)bytes;
+    (void)count;
+#endif
+}
+
+void headerToWire(const FrameHeader& header, FrameHeader& wire) {
+    wire.seq = (int64_t)htole64((uint64_t)header.seq);
+    wire.count = (int32_t)htole32((uint32_t)header.count);
+    wire.dim = (int32_t)htole32((uint32_t)header.dim);
+    wire.payload_bytes = htole32(header.payload_bytes);
+    wire.reserved = htole32(header.reserved);
+}
+
+void headerFromWire(const FrameHeader& wire, FrameHeader& header) {
+    header.seq = (int64_t)le64toh((uint64_t)wire.seq);
+    header.count = (int32_t)le32toh((uint32_t)wire.count);
+    header.dim = (int32_t)le32toh((uint32_t)wire.dim);
+    header.payload_bytes = le32toh(wire.payload_bytes);
+    header.reserved = le32toh(wire.reserved);
+}
+
+// Write as much buffered data as a non-blocking descriptor accepts right now;
+// returns false on a write error
+bool linkFlushAvailable(FrameLink& link) {
+    size_t done = 0;
+    while (done < link.pending.size()) {
+        ssize_t w = write(link.fd, link.pending.data() + done, link.pending.size() - done);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (w <= 0) return false;
+        done += w;
+    }
+    if (done > 0) {
+        link.sends++;
+        link.pending.erase(0, done);
+    }
+    return true;
+}
+
+// Group byte b of every double together so exponent bytes compress well.
+// Bytes are taken in little-endian order so compressed frames are portable too.
+void shuffleBytes(const unsigned char* in, unsigned char* out, size_t count) {
+    for (size_t b = 0; b < sizeof(double); b++) {
+        size_t src = hostByte(b);
+        for (size_t i = 0; i < count; i++) {
+            out[b * count + i] = in[i * sizeof(double) + src];
+        }
+    }
+}
+
+void unshuffleBytes(const unsigned char* in, unsigned char* out, size_t count) {
+    for (size_t b = 0; b < sizeof(double); b++) {
+        size_t dst = hostByte(b);
+        for (size_t i = 0; i < count; i++) {
+            out[i * sizeof(double) + dst] = in[b * count + i];
+        }
+    }
+}
+
+// Send count samples of dim values each as one frame
+bool linkSend(FrameLink& link, long seq, int count, int dim, const double* data) {
+    FrameHeader header;
+    header.seq = seq;
+    header.count = count;
+    header.dim = dim;
+    header.payload_bytes = 0;
+    header.reserved = 0;
+
+    size_t values = (size_t)count * dim;
+    size_t raw = values * sizeof(double);
+    const char* payload = (const char*)data;
+    size_t payload_size = raw;
+
+    if (link.compress && raw > 0) {
+        link.shuffled.resize(raw);
+        shuffleBytes((const unsigned char*)data, link.shuffled.data(), values);
+        uLongf packed_size = compressBound(raw);
+        link.packed.resize(packed_size);
+        if (compress2(link.packed.data(), &packed_size, link.shuffled.data(), raw,
+                      Z_BEST_SPEED) == Z_OK && packed_size < raw) {
+            header.payload_bytes = packed_size;
+            payload = (const char*)link.packed.data();
+            payload_size = packed_size;
+        }
+    }
+
+    FrameHeader wire;
+    headerToWire(header, wire);
+    link.pending.append((const char*)&wire, sizeof(wire));
+    size_t at = link.pending.size();
+    link.pending.append(payload, payload_size);
+    if (header.payload_bytes == 0) swapWireDoubles(&link.pending[at], values);
+    link.frames++;
+    link.raw_bytes += sizeof(header) + raw;
+    link.wire_bytes += sizeof(header) + payload_size;
+    if (link.pending.size() >= link.flush_bytes) return linkFlush(link);
+    return true;
+}
+
+// Receive the payload of a frame whose header was already read
+bool linkRecvPayload(FrameLink& link, const FrameHeader& header, double* out) {
+    size_t values = (size_t)header.count * header.dim;
+    size_t raw = values * sizeof(double);
+    if (header.payload_bytes == 0) {
+        if (!readFull(link.fd, out, raw)) return false;
+        swapWireDoubles((char*)out, values);
+        return true;
+    }
+
+    link.packed.resize(header.payload_bytes);
+    if (!readFull(link.fd, link.packed.data(), header.payload_bytes)) return false;
+    link.shuffled.resize(raw);
+    uLongf unpacked = raw;
+    if (uncompress(link.shuffled.data(), &unpacked, link.packed.data(),
+                   header.payload_bytes) != Z_OK || unpacked != raw) {
+        cerr << "Error: Corrupt compressed frame " << header.seq << endl;
+        return false;
+    }
+    unshuffleBytes(link.shuffled.data(), (unsigned char*)out, values);
+    return true;
+}
+
+// Read and check the header of the next frame before anything is sized from
+// it; dim is the width the receiver expects. Returns false on EOF or a bad header.
+bool linkRecvHeader(FrameLink& link, FrameHeader& header, int dim) {
+    FrameHeader wire;
+    if (!readFull(link.fd, &wire, sizeof(wire))) return false;
+    headerFromWire(wire, header);
+    if (header.count <= 0 || header.count > MAX_FRAME_SAMPLES || header.dim != dim) {
+        cerr << "Error: Bad frame header (seq " << header.seq << ", " << header.count
+             << " samples of width " << header.dim << ", expected width " << dim << ")" << endl;
+        return false;
+    }
+    size_t raw = (size_t)header.count * header.dim * sizeof(double);
+    if (header.payload_bytes > compressBound(raw)) {
+        cerr << "Error: Bad frame header (seq " << header.seq << ", "
+             << header.payload_bytes << " compressed bytes for " << raw << " raw)" << endl;
+        return false;
+    }
+    return true;
+}
+
+// Receive one frame of dim wide samples, returns false when the sender closed
+// the link or sent a malformed frame
+bool linkRecv(FrameLink& link, FrameHeader& header, vector<double>& data, int dim) {
+    if (!linkRecvHeader(link, header, dim)) return false;
+    data.resize((size_t)header.count * header.dim);
+    return linkRecvPayload(link, header, data.data());
+}
+
+// Receive one frame into a layer's activation buffer
+bool linkRecv(FrameLink& link, FrameHeader& header, ActivationBuffer& buffer, int dim) {
+    if (!linkRecvHeader(link, header, dim)) return false;
+    if (!reserveActivations(buffer, (size_t)header.count * header.dim)) return false;
+    return linkRecvPayload(link, header, buffer.data);
+}
+
+// True when a read on fd would not block
+bool inputReady(int fd) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, 0) > 0;
+}
+
+// Copy weight rows into the shared mapping and make it read-only again
+void fillSharedWeights(const vector<vector<double>>& rows, SharedWeights& shared) {
+    size_t line = 0;
+    for (const LayerShape& shape : shared.layers) {
+        for (int r = 0; r < shape.rows; r++, line++) {
+            const vector<double>& src = rows[line % rows.size()];
+            double* dst = shared.base + shape.offset + (size_t)r * shape.cols;
+            for (int c = 0; c < shape.cols; c++) {
+                dst[c] = src.empty() ? 0.0 : src[c % src.size()];
+            }
+        }
+    }
+    mprotect(shared.base, shared.bytes, PROT_READ);
+}
+
+// Allocate the shared weight mapping for the layer shapes already listed in
+// shared.layers and fill it row by row from input.txt, starting at line 1.
+// Rows and columns wrap around the file when it is smaller than the model.
+bool mapSharedWeights(const string& filename, SharedWeights& shared) {
+    vector<vector<double>> rows = readWeights(filename, 1, INT_MAX - 1);
+    if (rows.empty()) {
+        cerr << "Error: No weights found in " << filename << endl;
+        return false;
+    }
+
+    size_t total = 0;
+    for (LayerShape& shape : shared.layers) {
+        shape.offset = total;
+        total += (size_t)shape.rows * shape.cols;
+    }
+
+    shared.bytes = max((size_t)1, total) * sizeof(double);
+    shared.base = (double*)allocLarge(shared.bytes, true, "weights");
+    if (!shared.base) {
+        cerr << "Error: Cannot map weights: " << strerror(errno) << endl;
+        return false;
+    }
+
+    fillSharedWeights(rows, shared);
+    return true;
+}
+
+// Re-read input.txt into the existing mapping. Layer processes see the new
+// weights at once, so callers must make sure no frame is in flight.
+bool reloadSharedWeights(const string& filename, SharedWeights& shared) {
+    vector<vector<double>> rows = readWeights(filename, 1, INT_MAX - 1);
+    if (rows.empty()) {
+        cerr << "Error: No weights found in " << filename << endl;
+        return false;
+    }
+    mprotect(shared.base, shared.bytes, PROT_READ | PROT_WRITE);
+    fillSharedWeights(rows, shared);
+    return true;
+}
+
+// Load all layer weights of the linear pipeline into one shared mapping.
+// Layer shapes follow the interactive pipeline (2 input neurons, N-wide
+// hidden/output layers).
+bool loadSharedWeights(const string& filename, int input_dim, int hidden_layers,
+                       int neurons, SharedWeights& shared) {
+    int total_layers = 1 + hidden_layers + 1;
+    int prev = input_dim;
+    for (int l = 0; l < total_layers; l++) {
+        LayerShape shape;
+        shape.rows = (l == 0) ? 2 : neurons;
+        shape.cols = prev;
+        shape.offset = 0;
+        shared.layers.push_back(shape);
+        prev = shape.rows;
+    }
+    return mapSharedWeights(filename, shared);
+}
+
+// Weighted sums of one layer for a frame of count samples
+void computeLayer(const double* weights, int rows, int cols,
+                  const double* in, double* out, int count) {
+    for (int s = 0; s < count; s++) {
+        const double* x = in + (size_t)s * cols;
+        double* y = out + (size_t)s * rows;
+        for (int r = 0; r < rows; r++) {
+            const double* w = weights + (size_t)r * cols;
+            double sum = 0.0;
+            for (int c = 0; c < cols; c++) {
+                sum += x[c] * w[c];
+            }
+            y[r] = sum;
+        }
+    }
+}
+
+// Weighted sums of rows [row_begin, row_end) for a frame of count samples,
+// blocked into tile_rows x tile_cols weight tiles that are reused across the
+// samples of the frame. Sums accumulate in column order, so results match
+// computeLayer exactly. tile_cols 0 means whole rows.
+void computeLayerTiled(const double* weights, int rows, int cols, const double* in,
+                       double* out, int count, int row_begin, int row_end,
+                       int tile_rows, int tile_cols) {
+    if (tile_rows <= 0) tile_rows = rows;
+    if (tile_cols <= 0) tile_cols = cols;
+    for (int s = 0; s < count; s++) {
+        for (int r = row_begin; r < row_end; r++) {
+            out[(size_t)s * rows + r] = 0.0;
+        }
+    }
+    for (int r0 = row_begin; r0 < row_end; r0 += tile_rows) {
+        int r1 = min(r0 + tile_rows, row_end);
+        for (int c0 = 0; c0 < cols; c0 += tile_cols) {
+            int c1 = min(c0 + tile_cols, cols);
+            for (int s = 0; s < count; s++) {
+                const double* x = in + (size_t)s * cols;
+                double* y = out + (size_t)s * rows;
+                for (int r = r0; r < r1; r++) {
+                    const double* w = weights + (size_t)r * cols;
+                    double sum = y[r];
+                    for (int c = c0; c < c1; c++) {
+                        sum += x[c] * w[c];
+                    }
+                    y[r] = sum;
+                }
+            }
+        }
+    }
+}
+
+// Frame handed to the compute threads of a layer process
+struct LayerJob {
+    const double* weights;
+    int rows;
+    int cols;
+    const double* in;
+    double* out;
+    int count;
+};
+
+// Persistent compute threads of one layer process. Each frame is split into
+// row ranges; the layer process itself works on range 0.
+struct LayerWorkers {
+    LayerTuning tuning;
+    LayerCounters* counters;
+    vector<pthread_t> threads;
+    pthread_barrier_t start;
+    pthread_barrier_t done;
+    LayerJob job;
+    bool quit;
+};
+
+struct WorkerArg {
+    LayerWorkers* workers;
+    int index;
+};
+
+// Row range of worker index, aligned to the row tile size
+void computeRows(LayerWorkers& workers, int index) {
+    const LayerJob& job = workers.job;
+    int parts = workers.tuning.threads;
+    int tile = max(1, workers.tuning.tile_rows);
+    int tiles = (job.rows + tile - 1) / tile;
+    int begin = min(job.rows, (int)((long)tiles * index / parts) * tile);
+    int end = min(job.rows, (int)((long)tiles * (index + 1) / parts) * tile);
+    computeLayerTiled(job.weights, job.rows, job.cols, job.in, job.out, job.count,
+                      begin, end, workers.tuning.tile_rows, workers.tuning.tile_cols);
+}
+
+// Worker thread; with counters set it counts its own work in a per-thread slot
+void* layerWorker(void* arg) {
+    WorkerArg* worker = (WorkerArg*)arg;
+    LayerWorkers& workers = *worker->workers;
+    ThreadCounters* slot = NULL;
+    if (workers.counters && worker->index < MAX_COUNTED_THREADS) {
+        slot = &workers.counters->per_thread[worker->index];
+    }
+    PerfCounters perf;
+    if (slot) perfOpen(perf, false);
+    while (true) {
+        pthread_barrier_wait(&workers.start);
+        if (workers.quit) break;
+        computeRows(workers, worker->index);
+        pthread_barrier_wait(&workers.done);
+    }
+    if (slot) perfClose(perf, slot->values, slot->available);
+    delete worker;
+    return NULL;
+}
+
+void workersStart(LayerWorkers& workers, const LayerTuning& tuning, LayerCounters* counters) {
+    workers.tuning = tuning;
+    workers.counters = counters;
+    workers.tuning.threads = max(1, tuning.threads);
+    workers.quit = false;
+    if (workers.tuning.threads == 1) return;
+    pthread_barrier_init(&workers.start, NULL, workers.tuning.threads);
+    pthread_barrier_init(&workers.done, NULL, workers.tuning.threads);
+    workers.threads.resize(workers.tuning.threads - 1);
+    for (size_t i = 0; i < workers.threads.size(); i++) {
+        WorkerArg* arg = new WorkerArg;
+        arg->workers = &workers;
+        arg->index = i + 1;
+        pthread_create(&workers.threads[i], NULL, layerWorker, arg);
+    }
+}
+
+void workersRun(LayerWorkers& workers, const LayerJob& job) {
+    workers.job = job;
+    if (workers.tuning.threads == 1) {
+        computeRows(workers, 0);
+        return;
+    }
+    pthread_barrier_wait(&workers.start);
+    computeRows(workers, 0);
+    pthread_barrier_wait(&workers.done);
+}
+
+void workersStop(LayerWorkers& workers) {
+    if (workers.tuning.threads == 1) return;
+    workers.quit = true;
+    pthread_barrier_wait(&workers.start);
+    for (pthread_t thread : workers.threads) {
+        pthread_join(thread, NULL);
+    }
+    pthread_barrier_destroy(&workers.start);
+    pthread_barrier_destroy(&workers.done);
+}
+
+// Bind the calling process to cores [first, first + count)
+void pinToCores(int first, int count) {
+    int ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; i < count; i++) {
+        CPU_SET((first + i) % ncpu, &set);
+    }
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+// Layer process of a replica or TCP stage: handles frames until the previous
+// stage closes. Buffered sends are flushed whenever no input is waiting.
+void replicaLayerLoop(FrameLink& in, FrameLink& out, const SharedWeights& shared,
+                      int layer, bool is_output, const LayerTuning& tuning,
+                      LayerCounters* counters, bool report_pages) {
+    const LayerShape& shape = shared.layers[layer];
+    const double* weights = shared.base + shape.offset;
+    // Counters must be open before the workers exist; inherit only follows
+    // threads created afterwards
+    PerfCounters perf;
+    uint64_t samples = 0;
+    if (counters) perfOpen(perf, true);
+    LayerWorkers workers;
+    workersStart(workers, tuning, counters);
+    FrameHeader header;
+    ActivationBuffer inputs = {NULL, 0, "layer input"};
+    ActivationBuffer outputs = {NULL, 0, "layer output"};
+    vector<double> results;
+
+    while (linkRecv(in, header, inputs, shape.cols)) {
+        if (!reserveActivations(outputs, (size_t)header.count * shape.rows)) break;
+        LayerJob job = {weights, shape.rows, shape.cols, inputs.data, outputs.data, header.count};
+        workersRun(workers, job);
+        samples += header.count;
+        if (report_pages) {
+            reportPageUsage("layer " + to_string(layer) + " process");
+            report_pages = false;
+        }
+
+        if (!is_output) {
+            if (!linkSend(out, header.seq, header.count, shape.rows, outputs.data)) break;
+            if (!inputReady(in.fd) && !linkFlush(out)) break;
+            continue;
+        }
+
+        // Output layer sends f(x1), f(x2) of every sample back to the dispatcher
+        results.resize((size_t)header.count * 2);
+        for (int s = 0; s < header.count; s++) {
+            double sum = 0.0;
+            for (int r = 0; r < shape.rows; r++) {
+                sum += outputs.data[(size_t)s * shape.rows + r];
+            }
+            results[s * 2] = (sum * sum + sum + 1) / 2.0;
+            results[s * 2 + 1] = (sum * sum - sum) / 2.0;
+        }
+        if (!linkSend(out, header.seq, header.count, 2, results.data())) break;
+        if (!inputReady(in.fd) && !linkFlush(out)) break;
+    }
+
+    linkFlush(out);
+    workersStop(workers);
+    if (counters) {
+        perfClose(perf, counters->values, counters->available);
+        counters->samples = samples;
+        counters->flops = samples * 2 * shape.rows * shape.cols;
+        counters->weight_bytes = (uint64_t)shape.rows * shape.cols * sizeof(double);
+        // The inherited process counters include the joined workers, so the
+        // layer process's own share is what the workers did not count
+        counters->threads = min(workers.tuning.threads, MAX_COUNTED_THREADS);
+        ThreadCounters& own = counters->per_thread[0];
+        for (int i = 0; i < NUM_COUNTERS; i++) {
+            uint64_t workers_total = 0;
+            own.available[i] = counters->available[i];
+            for (int t = 1; t < counters->threads; t++) {
+                workers_total += counters->per_thread[t].values[i];
+                own.available[i] = own.available[i] && counters->per_thread[t].available[i];
+            }
+            own.values[i] = counters->values[i] > workers_total ? counters->values[i] - workers_total : 0;
+        }
+    }
+    releaseActivations(inputs);
+    releaseActivations(outputs);
+    close(in.fd);
+    close(out.fd);
+}
+
+// Connected descriptor pair of the configured IPC transport: [0] reads, [1] writes
+void openChannel(bool unix_socket, int fds[2]) {
+    if (unix_socket) {
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    } else {
+        pipe(fds);
+    }
+}
+
+// Fork the layer processes of one replica, bound to its own core group.
+// close_in_child lists dispatcher-side descriptors of earlier replicas.
+void startReplica(int index, int cores_per_replica, const SharedWeights& shared,
+                  const LayerTuning& tuning, const vector<int>& close_in_child,
+                  Replica& replica) {
+    int total_layers = shared.layers.size();
+    int first_pipe[2];
+    openChannel(tuning.unix_socket, first_pipe);
+
+    int read_fd = first_pipe[0];
+    linkInit(replica.in, first_pipe[1], false, 0);
+    replica.inflight = 0;
+
+    for (int l = 0; l < total_layers; l++) {
+        int next_pipe[2];
+        openChannel(tuning.unix_socket, next_pipe);
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(next_pipe[0]);
+            close(replica.in.fd);
+            for (int fd : close_in_child) {
+                close(fd);
+            }
+            pinToCores(index * cores_per_replica, cores_per_replica);
+            FrameLink in, out;
+            linkInit(in, read_fd, false, 0);
+            linkInit(out, next_pipe[1], false, 0);
+            LayerCounters* counters = layer_counters ? &layer_counters[index * total_layers + l] : NULL;
+            replicaLayerLoop(in, out, shared, l, l == total_layers - 1, tuning, counters,
+                             report_activation_pages && index == 0);
+            exit(0);
+        }
+
+        replica.pids.push_back(pid);
+        close(read_fd);
+        close(next_pipe[1]);
+        read_fd = next_pipe[0];
+    }
+
+    linkInit(replica.out, read_fd, false, 0);
+}
+
+// Close the replica inputs and wait for every layer process to exit
+void stopReplicas(vector<Replica>& replicas) {
+    for (Replica& replica : replicas) {
+        linkFlush(replica.in);
+        close(replica.in.fd);
+    }
+    for (Replica& replica : replicas) {
+        close(replica.out.fd);
+        for (pid_t pid : replica.pids) {
+            waitpid(pid, NULL, 0);
+        }
+    }
+}
+
+// ============================================================================
+// Streaming sample ingest and result output (--input-file / --output-file)
+// ============================================================================
+
+const size_t INGEST_CHUNK_BYTES = 1 << 20;
+const int BLOCK_SAMPLES = 4096;
+const int QUEUE_BLOCKS = 4;
+const char COLUMNAR_MAGIC[8] = {'N', 'N', 'C', 'O', 'L', '1', 0, 0};
+const char RESULT_MAGIC[8] = {'N', 'N', 'R', 'E', 'S', '1', 0, 0};
+// Limits on what a columnar header and row group may declare, checked before
+// anything is sized from them
+const uint32_t MAX_SAMPLE_COLUMNS = 1 << 16;
+const size_t MAX_GROUP_VALUES = 1 << 24;
+
+// Header of the binary columnar sample format. The header is followed by
+// row groups: a uint32 row count, then each column stored contiguously.
+struct ColumnarHeader {
+    char magic[8];
+    uint32_t cols;
+    uint32_t reserved;
+};
+
+// Block of samples (or results) handed between threads
+struct DataBlock {
+    int count;
+    int dim;
+    vector<double> values;
+};
+
+// Bounded producer/consumer queue of blocks
+struct BlockQueue {
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    deque<DataBlock*> blocks;
+    bool closed;
+};
+
+// Minimal io_uring submission/completion rings set up through raw syscalls
+struct UringRing {
+    int fd;
+    void* sq_ptr;
+    size_t sq_size;
+    void* cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+};
+
+// Double-buffered asynchronous file reader: one buffer is parsed while the
+// next chunk is read into the other, by io_uring or by a helper thread
+struct AsyncReader {
+    int fd;
+    off_t offset;
+    char* buffers[2];
+    int next;
+    bool use_uring;
+    UringRing ring;
+    struct iovec iov;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool request;
+    bool done;
+    bool quit;
+    ssize_t result;
+};
+
+// Byte stream over the async reader
+struct ByteStream {
+    AsyncReader reader;
+    int current;
+    size_t pos;
+    size_t len;
+    bool eof;
+    long bytes;
+};
+
+// Ingest stage: reader thread that parses a sample file into blocks
+struct IngestStream {
+    ByteStream stream;
+    BlockQueue queue;
+    pthread_t thread;
+    bool binary;
+    int dim;
+    DataBlock* current;
+    int pos;
+    double wait_seconds;
+    bool failed;
+};
+
+// Output stage: writer thread that formats and writes result blocks
+struct ResultWriter {
+    int fd;
+    string path;
+    int error;
+    bool binary;
+    BlockQueue queue;
+    pthread_t thread;
+    DataBlock* current;
+    double wait_seconds;
+};
+
+double elapsedSeconds(const struct timespec& start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+void queueInit(BlockQueue& queue) {
+    pthread_mutex_init(&queue.mutex, NULL);
+    pthread_cond_init(&queue.not_empty, NULL);
+    pthread_cond_init(&queue.not_full, NULL);
+    queue.closed = false;
+}
+
+void queueDestroy(BlockQueue& queue) {
+    for (DataBlock* block : queue.blocks) {
+        delete block;
+    }
+    queue.blocks.clear();
+    pthread_mutex_destroy(&queue.mutex);
+    pthread_cond_destroy(&queue.not_empty);
+    pthread_cond_destroy(&queue.not_full);
+}
+
+// Blocks while the queue is full; drops the block and returns false if the
+// queue was closed by the consumer
+bool queuePush(BlockQueue& queue, DataBlock* block) {
+    pthread_mutex_lock(&queue.mutex);
+    while (queue.blocks.size() >= (size_t)QUEUE_BLOCKS && !queue.closed) {
+        pthread_cond_wait(&queue.not_full, &queue.mutex);
+    }
+    bool accepted = !queue.closed;
+    if (accepted) {
+        queue.blocks.push_back(block);
+        pthread_cond_signal(&queue.not_empty);
+    } else {
+        delete block;
+    }
+    pthread_mutex_unlock(&queue.mutex);
+    return accepted;
+}
+
+// Returns NULL once the queue is closed and drained
+DataBlock* queuePop(BlockQueue& queue) {
+    pthread_mutex_lock(&queue.mutex);
+    while (queue.blocks.empty() && !queue.closed) {
+        pthread_cond_wait(&queue.not_empty, &queue.mutex);
+    }
+    DataBlock* block = NULL;
+    if (!queue.blocks.empty()) {
+        block = queue.blocks.front();
+        queue.blocks.pop_front();
+        pthread_cond_signal(&queue.not_full);
+    }
+    pthread_mutex_unlock(&queue.mutex);
+    return block;
+}
+
+void queueClose(BlockQueue& queue) {
+    pthread_mutex_lock(&queue.mutex);
+    queue.closed = true;
+    pthread_cond_broadcast(&queue.not_empty);
+    pthread_cond_broadcast(&queue.not_full);
+    pthread_mutex_unlock(&queue.mutex);
+}
+
+bool uringInit(UringRing& ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring.fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring.fd < 0) return false;
+
+    ring.sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        ring.sq_size = max(ring.sq_size, ring.cq_size);
+    }
+
+    ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ptr == MAP_FAILED) {
+        close(ring.fd);
+        return false;
+    }
+    ring.cq_ptr = ring.sq_ptr;
+    if (!single_mmap) {
+        ring.cq_ptr = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+        if (ring.cq_ptr == MAP_FAILED) {
+            munmap(ring.sq_ptr, ring.sq_size);
+            close(ring.fd);
+            return false;
+        }
+    }
+    ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        if (!single_mmap) munmap(ring.cq_ptr, ring.cq_size);
+        munmap(ring.sq_ptr, ring.sq_size);
+        close(ring.fd);
+        return false;
+    }
+    ring.sqes = (struct io_uring_sqe*)sqes;
+
+    char* sq = (char*)ring.sq_ptr;
+    char* cq = (char*)ring.cq_ptr;
+    ring.sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring.sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring.cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring.cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring.cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+void uringDestroy(UringRing& ring) {
+    munmap(ring.sqes, ring.sqes_size);
+    if (ring.cq_ptr != ring.sq_ptr) munmap(ring.cq_ptr, ring.cq_size);
+    munmap(ring.sq_ptr, ring.sq_size);
+    close(ring.fd);
+}
+
+bool uringSubmitRead(UringRing& ring, int fd, struct iovec* iov, off_t offset) {
+    unsigned tail = *ring.sq_tail;
+    unsigned index = tail & *ring.sq_mask;
+    struct io_uring_sqe* sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)iov;
+    sqe->len = 1;
+    sqe->off = offset;
+    ring.sq_array[index] = index;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return syscall(__NR_io_uring_enter, ring.fd, 1, 0, 0, NULL, 0) == 1;
+}
+
+ssize_t uringWait(UringRing& ring) {
+    while (true) {
+        unsigned head = *ring.cq_head;
+        if (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            ssize_t res = ring.cqes[head & *ring.cq_mask].res;
+            __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+            return res;
+        }
+        if (syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+            errno != EINTR) {
+            return -errno;
+        }
+    }
+}
+
+// Thread fallback: performs one pread per request
+void* readerThread(void* arg) {
+    AsyncReader* reader = (AsyncReader*)arg;
+    pthread_mutex_lock(&reader->mutex);
+    while (true) {
+        while (!reader->request && !reader->quit) {
+            pthread_cond_wait(&reader->cond, &reader->mutex);
+        }
+        if (reader->quit) break;
+        char* buf = (char*)reader->iov.iov_base;
+        size_t len = reader->iov.iov_len;
+        off_t offset = reader->offset;
+        pthread_mutex_unlock(&reader->mutex);
+
+        ssize_t n = pread(reader->fd, buf, len, offset);
+
+        pthread_mutex_lock(&reader->mutex);
+        reader->result = n < 0 ? -errno : n;
+        reader->request = false;
+        reader->done = true;
+        pthread_cond_broadcast(&reader->cond);
+    }
+    pthread_mutex_unlock(&reader->mutex);
+    return NULL;
+}
+
+// Start reading the next chunk into buffer index
+void asyncSubmit(AsyncReader& reader, int index) {
+    reader.iov.iov_base = reader.buffers[index];
+    reader.iov.iov_len = INGEST_CHUNK_BYTES;
+    reader.next = index;
+    if (reader.use_uring) {
+        if (uringSubmitRead(reader.ring, reader.fd, &reader.iov, reader.offset)) return;
+        // Submission refused (e.g. blocked by a seccomp filter): fall back to the thread
+        uringDestroy(reader.ring);
+        reader.use_uring = false;
+        pthread_create(&reader.thread, NULL, readerThread, &reader);
+    }
+    pthread_mutex_lock(&reader.mutex);
+    reader.request = true;
+    reader.done = false;
+    pthread_cond_broadcast(&reader.cond);
+    pthread_mutex_unlock(&reader.mutex);
+}
+
+// Wait for the outstanding read; returns bytes read, 0 at EOF, <0 on error
+ssize_t asyncWait(AsyncReader& reader) {
+    ssize_t n;
+    if (reader.use_uring) {
+        n = uringWait(reader.ring);
+    } else {
+        pthread_mutex_lock(&reader.mutex);
+        while (!reader.done) {
+            pthread_cond_wait(&reader.cond, &reader.mutex);
+        }
+        n = reader.result;
+        pthread_mutex_unlock(&reader.mutex);
+    }
+    if (n > 0) reader.offset += n;
+    return n;
+}
+
+bool streamOpen(ByteStream& stream, const string& path) {
+    AsyncReader& reader = stream.reader;
+    reader.fd = open(path.c_str(), O_RDONLY);
+    if (reader.fd < 0) {
+        cerr << "Error: Cannot open " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+    posix_fadvise(reader.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    reader.offset = 0;
+    reader.buffers[0] = new char[INGEST_CHUNK_BYTES];
+    reader.buffers[1] = new char[INGEST_CHUNK_BYTES];
+    reader.request = false;
+    reader.done = false;
+    reader.quit = false;
+    pthread_mutex_init(&reader.mutex, NULL);
+    pthread_cond_init(&reader.cond, NULL);
+    reader.use_uring = uringInit(reader.ring, 2);
+    if (!reader.use_uring) {
+        pthread_create(&reader.thread, NULL, readerThread, &reader);
+    }
+
+    stream.current = 1;
+    stream.pos = 0;
+    stream.len = 0;
+    stream.eof = false;
+    stream.bytes = 0;
+    asyncSubmit(reader, 0);
+    return true;
+}
+
+void streamClose(ByteStream& stream) {
+    AsyncReader& reader = stream.reader;
+    if (!stream.eof) {
+        asyncWait(reader);
+    }
+    if (reader.use_uring) {
+        uringDestroy(reader.ring);
+    } else {
+        pthread_mutex_lock(&reader.mutex);
+        reader.quit = true;
+        pthread_cond_broadcast(&reader.cond);
+        pthread_mutex_unlock(&reader.mutex);
+        pthread_join(reader.thread, NULL);
+    }
+    pthread_mutex_destroy(&reader.mutex);
+    pthread_cond_destroy(&reader.cond);
+    delete[] reader.buffers[0];
+    delete[] reader.buffers[1];
+    close(reader.fd);
+}
+
+// Switch to the buffer whose read just completed and start the next read
+// into the buffer that was consumed
+bool streamRefill(ByteStream& stream) {
+    if (stream.eof) return false;
+    ssize_t n = asyncWait(stream.reader);
+    if (n <= 0) {
+        if (n < 0) cerr << "Error: Read failed: " << strerror(-n) << endl;
+        stream.eof = true;
+        return false;
+    }
+    stream.current = stream.reader.next;
+    stream.pos = 0;
+    stream.len = n;
+    stream.bytes += n;
+    asyncSubmit(stream.reader, 1 - stream.current);
+    return true;
+}
+
+// Copy up to n bytes out of the stream; returns the number copied, which is
+// less than n only at the end of the stream
+size_t streamTake(ByteStream& stream, void* dst, size_t n) {
+    char* out = (char*)dst;
+    size_t taken = 0;
+    while (taken < n) {
+        if (stream.pos == stream.len && !streamRefill(stream)) break;
+        size_t chunk = min(n - taken, stream.len - stream.pos);
+        memcpy(out + taken, stream.reader.buffers[stream.current] + stream.pos, chunk);
+        stream.pos += chunk;
+        taken += chunk;
+    }
+    return taken;
+}
+
+// Next line without the newline; returns false at EOF
+bool streamLine(ByteStream& stream, string& line) {
+    line.clear();
+    while (true) {
+        if (stream.pos == stream.len && !streamRefill(stream)) return !line.empty();
+        const char* start = stream.reader.buffers[stream.current] + stream.pos;
+        size_t avail = stream.len - stream.pos;
+        const char* newline = (const char*)memchr(start, '\n', avail);
+        if (newline) {
+            line.append(start, newline - start);
+            stream.pos += newline - start + 1;
+            return true;
+        }
+        line.append(start, avail);
+        stream.pos = stream.len;
+    }
+}
+
+// Fast comma-separated parse used by the ingest stage
+void parseSampleLine(const string& line, vector<double>& values) {
+    values.clear();
+    const char* p = line.c_str();
+    char* end;
+    while (*p) {
+        double value = strtod(p, &end);
+        if (end == p) {
+            p++;
+            continue;
+        }
+        values.push_back(value);
+        p = end;
+    }
+}
+
+// Hand a full block to the consumer; false once the consumer stopped reading
+bool ingestPushBlock(IngestStream& ingest, DataBlock*& block) {
+    bool accepted = queuePush(ingest.queue, block);
+    block = NULL;
+    return accepted;
+}
+
+// Ingest thread: parses the byte stream into blocks of BLOCK_SAMPLES samples
+void* ingestThread(void* arg) {
+    IngestStream* ingest = (IngestStream*)arg;
+    DataBlock* block = NULL;
+    int dim = ingest->dim;
+    bool stopped = false;
+
+    if (ingest->binary) {
+        vector<double> group;
+        uint32_t rows;
+        while (!stopped) {
+            size_t taken = streamTake(ingest->stream, &rows, sizeof(rows));
+            if (taken == 0) break;
+            if (taken < sizeof(rows)) {
+                cerr << "Error: Truncated row count in columnar input" << endl;
+                ingest->failed = true;
+                break;
+            }
+            if ((size_t)rows * dim > MAX_GROUP_VALUES) {
+                cerr << "Error: Corrupt row group in columnar input (" << rows
+                     << " rows of " << dim << " columns)" << endl;
+                ingest->failed = true;
+                break;
+            }
+            group.resize((size_t)rows * dim);
+            size_t group_bytes = group.size() * sizeof(double);
+            if (streamTake(ingest->stream, group.data(), group_bytes) < group_bytes) {
+                cerr << "Error: Truncated row group in columnar input" << endl;
+                ingest->failed = true;
+                break;
+            }
+            // Transpose the columns of the row group into row-major samples
+            for (uint32_t r = 0; r < rows && !stopped; r++) {
+                if (!block) {
+                    block = new DataBlock();
+                    block->count = 0;
+                    block->dim = dim;
+                    block->values.resize((size_t)BLOCK_SAMPLES * dim);
+                }
+                double* out = &block->values[(size_t)block->count * dim];
+                for (int c = 0; c < dim; c++) {
+                    out[c] = group[(size_t)c * rows + r];
+                }
+                if (++block->count == BLOCK_SAMPLES) stopped = !ingestPushBlock(*ingest, block);
+            }
+        }
+    } else {
+        string line;
+        vector<double> values;
+        long line_num = 0;
+        while (!stopped && streamLine(ingest->stream, line)) {
+            line_num++;
+            parseSampleLine(line, values);
+            if (values.empty()) continue;
+            if (dim == 0) {
+                dim = values.size();
+                ingest->dim = dim;
+            }
+            if ((int)values.size() != dim) {
+                cerr << "Warning: Skipping line " << line_num << " with " << values.size()
+                     << " values (expected " << dim << ")" << endl;
+                continue;
+            }
+            if (!block) {
+                block = new DataBlock();
+                block->count = 0;
+                block->dim = dim;
+                block->values.resize((size_t)BLOCK_SAMPLES * dim);
+            }
+            memcpy(&block->values[(size_t)block->count * dim], values.data(), dim * sizeof(double));
+            if (++block->count == BLOCK_SAMPLES) stopped = !ingestPushBlock(*ingest, block);
+        }
+    }
+
+    if (block) ingestPushBlock(*ingest, block);
+    queueClose(ingest->queue);
+    return NULL;
+}
+
+// Open a text or binary columnar sample file and start the ingest thread.
+// The first block is read ahead so that the input width is known.
+bool ingestOpen(IngestStream& ingest, const string& path) {
+    if (!streamOpen(ingest.stream, path)) return false;
+    queueInit(ingest.queue);
+    ingest.binary = false;
+    ingest.dim = 0;
+    ingest.current = NULL;
+    ingest.pos = 0;
+    ingest.wait_seconds = 0.0;
+    ingest.failed = false;
+
+    ColumnarHeader header;
+    int fd = ingest.stream.reader.fd;
+    if (pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+        memcmp(header.magic, COLUMNAR_MAGIC, sizeof(COLUMNAR_MAGIC)) == 0) {
+        if (header.cols == 0 || header.cols > MAX_SAMPLE_COLUMNS) {
+            cerr << "Error: " << path << ": bad columnar header (" << header.cols
+                 << " columns)" << endl;
+            queueDestroy(ingest.queue);
+            streamClose(ingest.stream);
+            return false;
+        }
+        ingest.binary = true;
+        ingest.dim = header.cols;
+        streamTake(ingest.stream, &header, sizeof(header));
+    }
+
+    pthread_create(&ingest.thread, NULL, ingestThread, &ingest);
+    ingest.current = queuePop(ingest.queue);
+    if (ingest.current) {
+        ingest.dim = ingest.current->dim;
+    }
+    return true;
+}
+
+// Next sample of the stream; returns false at the end
+bool ingestNext(IngestStream& ingest, double* out) {
+    if (ingest.current && ingest.pos == ingest.current->count) {
+        delete ingest.current;
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ingest.current = queuePop(ingest.queue);
+        ingest.wait_seconds += elapsedSeconds(start);
+        ingest.pos = 0;
+    }
+    if (!ingest.current) return false;
+    memcpy(out, &ingest.current->values[(size_t)ingest.pos * ingest.dim], ingest.dim * sizeof(double));
+    ingest.pos++;
+    return true;
+}
+
+// Stop the ingest thread; returns false if the input had a format error
+bool ingestClose(IngestStream& ingest) {
+    queueClose(ingest.queue);
+    pthread_join(ingest.thread, NULL);
+    delete ingest.current;
+    queueDestroy(ingest.queue);
+    streamClose(ingest.stream);
+    return !ingest.failed;
+}
+
+// Writer thread: formats result blocks and writes them with large writes.
+// After a failed write the remaining blocks are drained and dropped, and the
+// error is reported by writerClose.
+void* writerThread(void* arg) {
+    ResultWriter* writer = (ResultWriter*)arg;
+    string text;
+    char number[64];
+    DataBlock* block;
+    while ((block = queuePop(writer->queue)) != NULL) {
+        if (writer->error) {
+            delete block;
+            continue;
+        }
+        bool ok;
+        if (writer->binary) {
+            ok = writeFull(writer->fd, block->values.data(),
+                           (size_t)block->count * block->dim * sizeof(double));
+        } else {
+            text.clear();
+            for (int s = 0; s < block->count; s++) {
+                for (int c = 0; c < block->dim; c++) {
+                    int len = snprintf(number, sizeof(number), c == 0 ? "%.4f" : ", %.4f",
+                                       block->values[(size_t)s * block->dim + c]);
+                    text.append(number, len);
+                }
+                text += '\n';
+            }
+            ok = writeFull(writer->fd, text.data(), text.size());
+        }
+        if (!ok) writer->error = errno ? errno : EIO;
+        delete block;
+    }
+    return NULL;
+}
+
+bool writerOpen(ResultWriter& writer, const string& path, bool binary) {
+    writer.fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (writer.fd < 0) {
+        cerr << "Error: Cannot open " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+    writer.path = path;
+    writer.error = 0;
+    writer.binary = binary;
+    writer.current = NULL;
+    writer.wait_seconds = 0.0;
+    if (binary) {
+        ColumnarHeader header;
+        memcpy(header.magic, RESULT_MAGIC, sizeof(RESULT_MAGIC));
+        header.cols = 2;
+        header.reserved = 0;
+        if (!writeFull(writer.fd, &header, sizeof(header))) {
+            cerr << "Error: Cannot write " << path << ": " << strerror(errno) << endl;
+            close(writer.fd);
+            return false;
+        }
+    }
+    queueInit(writer.queue);
+    pthread_create(&writer.thread, NULL, writerThread, &writer);
+    return true;
+}
+
+// Queue one result row; only blocks when the writer is QUEUE_BLOCKS behind
+void writerPush(ResultWriter& writer, const double* row, int dim) {
+    if (!writer.current) {
+        writer.current = new DataBlock();
+        writer.current->count = 0;
+        writer.current->dim = dim;
+        writer.current->values.resize((size_t)BLOCK_SAMPLES * dim);
+    }
+    memcpy(&writer.current->values[(size_t)writer.current->count * dim], row, dim * sizeof(double));
+    if (++writer.current->count == BLOCK_SAMPLES) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        queuePush(writer.queue, writer.current);
+        writer.wait_seconds += elapsedSeconds(start);
+        writer.current = NULL;
+    }
+}
+
+// Flush and stop the writer; returns false if any result was not written
+bool writerClose(ResultWriter& writer) {
+    if (writer.current) {
+        queuePush(writer.queue, writer.current);
+        writer.current = NULL;
+    }
+    queueClose(writer.queue);
+    pthread_join(writer.thread, NULL);
+    queueDestroy(writer.queue);
+    if (close(writer.fd) != 0 && !writer.error) writer.error = errno;
+    if (writer.error) {
+        cerr << "Error: Writing " << writer.path << " failed: " << strerror(writer.error) << endl;
+        return false;
+    }
+    return true;
+}
+
+// ============================================================================
+// Memoizing output cache (--cache N)
+// ============================================================================
+
+// Cached result of one input vector under one weight version
+struct CacheEntry {
+    uint64_t key;
+    vector<double> input;
+    double result[2];
+};
+
+// One lock-protected LRU list; the front is the most recently used entry
+struct CacheShard {
+    pthread_mutex_t mutex;
+    list<CacheEntry> lru;
+    unordered_map<uint64_t, list<CacheEntry>::iterator> index;
+    uint64_t version;
+    long hits;
+    long misses;
+    long evictions;
+    long invalidations;
+};
+
+// Bounded LRU cache in front of the pipeline, sharded by key so that
+// concurrent lookups rarely contend on the same mutex
+struct OutputCache {
+    vector<CacheShard*> shards;
+    size_t shard_capacity;
+};
+
+// 64-bit hash of a vector of doubles, seeded with the weight version
+uint64_t hashValues(const double* values, size_t count, uint64_t seed) {
+    uint64_t h = seed ^ (count * 0x9E3779B97F4A7C15ULL);
+    for (size_t i = 0; i < count; i++) {
+        uint64_t word;
+        memcpy(&word, &values[i], sizeof(word));
+        word *= 0xBF58476D1CE4E5B9ULL;
+        word ^= word >> 31;
+        h = (h ^ word) * 0x94D049BB133111EBULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+// Version of the loaded weights; any change to them changes every cache key
+uint64_t weightVersion(const SharedWeights& shared) {
+    return hashValues(shared.base, shared.bytes / sizeof(double), 0x5EED);
+}
+
+void cacheInit(OutputCache& cache, size_t capacity, int num_shards) {
+    num_shards = max(1, num_shards);
+    cache.shard_capacity = max((size_t)1, (capacity + num_shards - 1) / num_shards);
+    for (int i = 0; i < num_shards; i++) {
+        CacheShard* shard = new CacheShard();
+        pthread_mutex_init(&shard->mutex, NULL);
+        shard->version = 0;
+        shard->hits = 0;
+        shard->misses = 0;
+        shard->evictions = 0;
+        shard->invalidations = 0;
+        cache.shards.push_back(shard);
+    }
+}
+
+void cacheDestroy(OutputCache& cache) {
+    for (CacheShard* shard : cache.shards) {
+        pthread_mutex_destroy(&shard->mutex);
+        delete shard;
+    }
+    cache.shards.clear();
+}
+
+// Lock the shard owning key and drop its entries if they belong to an older
+// weight version
+CacheShard& cacheLockShard(OutputCache& cache, uint64_t key, uint64_t version) {
+    CacheShard& shard = *cache.shards[(key >> 48) % cache.shards.size()];
+    pthread_mutex_lock(&shard.mutex);
+    if (shard.version != version) {
+        if (!shard.lru.empty()) shard.invalidations++;
+        shard.lru.clear();
+        shard.index.clear();
+        shard.version = version;
+    }
+    return shard;
+}
+
+bool cacheLookup(OutputCache& cache, const double* input, int dim, uint64_t version,
+                 double* result) {
+    uint64_t key = hashValues(input, dim, version);
+    CacheShard& shard = cacheLockShard(cache, key, version);
+    bool hit = false;
+    unordered_map<uint64_t, list<CacheEntry>::iterator>::iterator found = shard.index.find(key);
+    if (found != shard.index.end() && (int)found->second->input.size() == dim &&
+        memcmp(found->second->input.data(), input, dim * sizeof(double)) == 0) {
+        shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+        result[0] = found->second->result[0];
+        result[1] = found->second->result[1];
+        hit = true;
+        shard.hits++;
+    } else {
+        shard.misses++;
+    }
+    pthread_mutex_unlock(&shard.mutex);
+    return hit;
+}
+
+void cacheInsert(OutputCache& cache, const double* input, int dim, uint64_t version,
+                 const double* result) {
+    uint64_t key = hashValues(input, dim, version);
+    CacheShard& shard = cacheLockShard(cache, key, version);
+    unordered_map<uint64_t, list<CacheEntry>::iterator>::iterator found = shard.index.find(key);
+    if (found != shard.index.end()) {
+        shard.lru.erase(found->second);
+        shard.index.erase(found);
+    }
+    if (shard.lru.size() >= cache.shard_capacity) {
+        shard.index.erase(shard.lru.back().key);
+        shard.lru.pop_back();
+        shard.evictions++;
+    }
+    CacheEntry entry;
+    entry.key = key;
+    entry.input.assign(input, input + dim);
+    entry.result[0] = result[0];
+    entry.result[1] = result[1];
+    shard.lru.push_front(entry);
+    shard.index[key] = shard.lru.begin();
+    pthread_mutex_unlock(&shard.mutex);
+}
+
+void reportCache(OutputCache& cache) {
+    long hits = 0, misses = 0, evictions = 0, invalidations = 0, entries = 0;
+    for (CacheShard* shard : cache.shards) {
+        pthread_mutex_lock(&shard->mutex);
+        hits += shard->hits;
+        misses += shard->misses;
+        evictions += shard->evictions;
+        invalidations += shard->invalidations;
+        entries += shard->lru.size();
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    long lookups = hits + misses;
+    cout << "  cache: " << hits << " hits, " << misses << " misses ("
+         << fixed << setprecision(1) << (lookups ? 100.0 * hits / lookups : 0.0) << "% hit rate), "
+         << entries << " entries in " << cache.shards.size() << " shards, " << evictions
+         << " evictions, " << invalidations << " shard invalidations" << endl;
+}
+
+// Deterministic sample stream derived from the first line of input.txt
+void makeSample(const vector<double>& base, long seq, double* out) {
+    for (size_t i = 0; i < base.size(); i++) {
+        out[i] = base[i] + 0.01 * (seq % 100);
+    }
+}
+
+// Where the dispatcher takes samples from and where results go
+struct SampleFeed {
+    IngestStream* ingest;
+    vector<double> base;
+    long limit;
+    ResultWriter* writer;
+    OutputCache* cache;
+    SharedWeights* weights;
+    string weights_file;
+};
+
+// True once the weight file's modification time moves past seen
+bool weightsModified(const string& filename, struct timespec& seen) {
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) return false;
+    if (st.st_mtim.tv_sec == seen.tv_sec && st.st_mtim.tv_nsec == seen.tv_nsec) return false;
+    seen = st.st_mtim;
+    return true;
+}
+
+// Synthetic stream of up to limit samples (0: unlimited) with no ingest,
+// writer or cache attached
+void feedInit(SampleFeed& feed, const vector<double>& base, long limit) {
+    feed.ingest = NULL;
+    feed.base = base;
+    feed.limit = limit;
+    feed.writer = NULL;
+    feed.cache = NULL;
+    feed.weights = NULL;
+    feed.weights_file.clear();
+}
+
+// Sample limit of a run: --samples, or 10000 synthetic samples by default
+long sampleLimit(const RunOptions& options) {
+    if (options.samples == 0 && options.input_file.empty()) return 10000;
+    return options.samples;
+}
+
+// Write results to output.txt under title unless --output-file already
+// streamed them, and say where they went
+void saveResults(const RunOptions& options, const string& title,
+                 const vector<vector<double>>& results) {
+    if (!options.output_file.empty()) {
+        cout << "Results saved to " << options.output_file << endl;
+        return;
+    }
+    ofstream output_file("output.txt");
+    output_file << "=== " << title << " ===" << endl;
+    for (size_t i = 0; i < results.size(); i++) {
+        output_file << "Sample " << i << ": f(x1) = " << fixed << setprecision(4)
+                    << results[i][0] << ", f(x2) = " << results[i][1] << endl;
+    }
+    output_file.close();
+    cout << "Results saved to output.txt" << endl;
+}
+
+// Next sample from the ingest stage or the synthetic stream
+bool feedNext(SampleFeed& feed, long seq, double* out) {
+    if (feed.limit > 0 && seq >= feed.limit) return false;
+    if (feed.ingest) return ingestNext(*feed.ingest, out);
+    makeSample(feed.base, seq, out);
+    return true;
+}
+
+// Push samples through already started replicas in frames of up to
+// options.batch samples, with at most options.window frames in flight per
+// replica, and collect results in order. Replica inputs are written without
+// blocking while results are drained, since a blocked send could otherwise
+// wait on an output layer that is itself blocked on a full result pipe. With feed.cache set, samples that
+// hit the cache skip the replicas, and a change to the weight file drains the
+// pipeline, reloads the weights and invalidates the cache. Stops the replicas
+// and stores the elapsed time in seconds. Returns false if a replica failed or,
+// for a synthetic stream of known length, not every sample completed.
+bool runDispatcher(const RunOptions& options, SampleFeed& feed, vector<Replica>& replicas,
+                   int dim, vector<vector<double>>& results, long& completed, double& seconds) {
+    int num_replicas = replicas.size();
+    int batch = max(1, options.batch);
+    long window = (long)options.window * batch;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Entries [0, num_replicas) read results, the rest write inputs
+    vector<struct pollfd> fds(2 * num_replicas);
+    for (int r = 0; r < num_replicas; r++) {
+        fds[r].fd = replicas[r].out.fd;
+        fds[r].events = POLLIN;
+        fds[num_replicas + r].fd = replicas[r].in.fd;
+        fcntl(replicas[r].in.fd, F_SETFL, fcntl(replicas[r].in.fd, F_GETFL) | O_NONBLOCK);
+        replicas[r].in.flush_bytes = SIZE_MAX;
+    }
+
+    // Results arrive out of order across replicas; the reorder buffer
+    // releases them strictly by sequence number
+    map<long, vector<double>> pending;
+    long next_send = 0;
+    long next_emit = 0;
+    bool input_done = false;
+    int cursor = 0;
+    vector<double> samples((size_t)batch * dim);
+    FrameHeader header;
+    vector<double> data;
+
+    // Inputs of frames in flight, keyed by first sequence number, so their
+    // results can be added to the cache when they come back
+    map<long, vector<double>> sent;
+    uint64_t version = 0;
+    bool watch = feed.cache && feed.weights && !feed.weights_file.empty();
+    bool reload = false;
+    long next_check = 0;
+    struct timespec weights_mtime = {0, 0};
+    if (feed.cache) version = weightVersion(*feed.weights);
+    if (watch) weightsModified(feed.weights_file, weights_mtime);
+    double hit[2];
+    // Hits add no in-flight work, so the reorder backlog is bounded
+    // separately to keep memory flat and the writer fed
+    long backlog = (long)window * num_replicas;
+    bool ok = true;
+
+    results.clear();
+    while (!input_done || next_emit < next_send) {
+        while (!input_done && !reload && next_send - next_emit < backlog) {
+            int target = cursor;
+            if (options.least_loaded) {
+                for (int r = 0; r < num_replicas; r++) {
+                    if (replicas[r].inflight < replicas[target].inflight) target = r;
+                }
+            }
+            if (replicas[target].inflight + batch > window) break;
+
+            // A cache hit ends the frame early so that every frame still
+            // covers consecutive sequence numbers
+            int count = 0;
+            bool cached = false;
+            while (count < batch) {
+                double* sample = &samples[(size_t)count * dim];
+                if (!feedNext(feed, next_send + count, sample)) {
+                    input_done = true;
+                    break;
+                }
+                if (feed.cache && cacheLookup(*feed.cache, sample, dim, version, hit)) {
+                    cached = true;
+                    break;
+                }
+                count++;
+            }
+            if (count == 0 && !cached) break;
+
+            if (count > 0) {
+                linkSend(replicas[target].in, next_send, count, dim, samples.data());
+                if (feed.cache) {
+                    sent[next_send].assign(samples.begin(), samples.begin() + (size_t)count * dim);
+                }
+                replicas[target].inflight += count;
+                next_send += count;
+                cursor = (cursor + 1) % num_replicas;
+            }
+            if (cached) {
+                pending[next_send] = vector<double>(hit, hit + 2);
+                next_send++;
+            }
+
+            if (watch && next_send >= next_check) {
+                next_check = next_send + 1024;
+                reload = weightsModified(feed.weights_file, weights_mtime);
+            }
+        }
+        bool failed = false;
+        for (int r = 0; r < num_replicas; r++) {
+            if (!linkFlushAvailable(replicas[r].in)) {
+                cerr << "Error: Cannot send to replica " << r << ": " << strerror(errno) << endl;
+                failed = true;
+            }
+            fds[num_replicas + r].events = replicas[r].in.pending.empty() ? 0 : POLLOUT;
+        }
+        if (failed) {
+            ok = false;
+            break;
+        }
+
+        while (!pending.empty() && pending.begin()->first == next_emit) {
+            const vector<double>& frame = pending.begin()->second;
+            for (size_t i = 0; i + 2 <= frame.size(); i += 2) {
+                if (feed.writer) {
+                    writerPush(*feed.writer, &frame[i], 2);
+                } else {
+                    results.push_back(vector<double>(frame.begin() + i, frame.begin() + i + 2));
+                }
+                next_emit++;
+            }
+            pending.erase(pending.begin());
+        }
+
+        int inflight = 0;
+        for (const Replica& replica : replicas) {
+            inflight += replica.inflight;
+        }
+        if (inflight == 0) {
+            // The pipeline is drained, so no layer can observe a half
+            // written weight matrix
+            if (reload) {
+                reloadSharedWeights(feed.weights_file, *feed.weights);
+                version = weightVersion(*feed.weights);
+                reload = false;
+                cout << "  weights changed, reloaded " << feed.weights_file
+                     << " at sample " << next_send << endl;
+            }
+            continue;
+        }
+
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            ok = false;
+            break;
+        }
+        for (int r = 0; r < num_replicas; r++) {
+            if (!(fds[r].revents & (POLLIN | POLLHUP))) continue;
+            if (!linkRecv(replicas[r].out, header, data, 2)) {
+                cerr << "Error: Replica " << r << " exited early" << endl;
+                failed = true;
+                break;
+            }
+            replicas[r].inflight -= header.count;
+            if (feed.cache) {
+                map<long, vector<double>>::iterator inputs = sent.find(header.seq);
+                if (inputs != sent.end()) {
+                    for (int i = 0; i < header.count && (size_t)(i + 1) * 2 <= data.size(); i++) {
+                        cacheInsert(*feed.cache, &inputs->second[(size_t)i * dim], dim,
+                                    version, &data[(size_t)i * 2]);
+                    }
+                    sent.erase(inputs);
+                }
+            }
+            pending[header.seq] = data;
+        }
+        if (failed) {
+            ok = false;
+            break;
+        }
+    }
+
+    stopReplicas(replicas);
+    completed = next_emit;
+    seconds = elapsedSeconds(start);
+    if (ok && feed.limit > 0 && !feed.ingest && completed != feed.limit) {
+        cerr << "Error: Completed " << completed << " of " << feed.limit << " samples" << endl;
+        ok = false;
+    }
+    return ok;
+}
+
+// Fork num_replicas local replicas and run the dispatcher over them. seconds
+// includes starting the replicas; returns false if the run failed.
+bool dispatchSamples(const RunOptions& options, const SharedWeights& shared,
+                     SampleFeed& feed, int num_replicas,
+                     vector<vector<double>>& results, long& completed, double& seconds) {
+    int ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int cores_per_replica = max(1, ncpu / num_replicas);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    vector<Replica> replicas(num_replicas);
+    vector<int> dispatcher_fds;
+    for (int r = 0; r < num_replicas; r++) {
+        startReplica(r, cores_per_replica, shared, options.tuning, dispatcher_fds, replicas[r]);
+        dispatcher_fds.push_back(replicas[r].in.fd);
+        dispatcher_fds.push_back(replicas[r].out.fd);
+    }
+
+    double dispatch_seconds;
+    bool ok = runDispatcher(options, feed, replicas, shared.layers[0].cols, results, completed,
+                            dispatch_seconds);
+    seconds = elapsedSeconds(start);
+    return ok;
+}
+
+// ============================================================================
+// Per-host autotuner (--autotune) and persisted profiles
+// ============================================================================
+
+const char* DEFAULT_PROFILE = "nn_autotune.profile";
+
+// Profile key: CPU model, online CPU count and every layer shape (rows x cols)
+string profileKey(const SharedWeights& shared) {
+    string model = "unknown-cpu";
+    ifstream cpuinfo("/proc/cpuinfo");
+    string line;
+    while (getline(cpuinfo, line)) {
+        if (line.compare(0, 10, "model name") == 0 && line.find(':') != string::npos) {
+            model = line.substr(line.find(':') + 2);
+            break;
+        }
+    }
+    replace(model.begin(), model.end(), ' ', '_');
+
+    stringstream key;
+    key << model << "/" << sysconf(_SC_NPROCESSORS_ONLN) << "cpu/";
+    for (size_t l = 0; l < shared.layers.size(); l++) {
+        key << (l ? "-" : "") << shared.layers[l].rows << "x" << shared.layers[l].cols;
+    }
+    return key.str();
+}
+
+string describeTuning(const RunOptions& options) {
+    stringstream ss;
+    ss << "threads=" << options.tuning.threads << " tile_rows=" << options.tuning.tile_rows
+       << " tile_cols=" << options.tuning.tile_cols << " batch=" << options.batch
+       << " transport=" << (options.tuning.unix_socket ? "unix" : "pipe");
+    return ss.str();
+}
+
+// Apply the profile entry for key to every parameter not given on the command line
+bool loadProfile(const string& path, const string& key, RunOptions& options) {
+    ifstream file(path);
+    string line;
+    while (getline(file, line)) {
+        stringstream ss(line);
+        string entry_key, field;
+        if (!(ss >> entry_key) || entry_key != key) continue;
+        while (ss >> field) {
+            size_t eq = field.find('=');
+            if (eq == string::npos) continue;
+            string name = field.substr(0, eq);
+            string value = field.substr(eq + 1);
+            int number = atoi(value.c_str());
+            if (name == "threads" && options.tuning.threads == 0) options.tuning.threads = number;
+            if (name == "tile_rows" && options.tuning.tile_rows < 0) options.tuning.tile_rows = number;
+            if (name == "tile_cols" && options.tuning.tile_cols < 0) options.tuning.tile_cols = number;
+            if (name == "batch" && options.batch == 0) options.batch = number;
+            if (name == "transport" && options.transport.empty()) options.transport = value;
+        }
+        return true;
+    }
+    return false;
+}
+
+// Fill parameters still unset after the profile with the defaults
+void finalizeTuning(RunOptions& options) {
+    if (options.tuning.threads <= 0) options.tuning.threads = 1;
+    if (options.tuning.tile_rows < 0) options.tuning.tile_rows = 0;
+    if (options.tuning.tile_cols < 0) options.tuning.tile_cols = 0;
+    if (options.batch <= 0) options.batch = 1;
+    options.batch = min(options.batch, MAX_FRAME_SAMPLES);
+    options.tuning.unix_socket = (options.transport == "unix");
+}
+
+// Load the profile of this host and model (if any) and finalize the tuning
+void applyProfile(RunOptions& options, const SharedWeights& shared) {
+    string key = profileKey(shared);
+    if (loadProfile(options.profile_file, key, options)) {
+        cout << "Loaded autotune profile " << options.profile_file << " for " << key << endl;
+    }
+    finalizeTuning(options);
+}
+
+// Replace (or add) the profile entry for key
+bool saveProfile(const string& path, const string& key, const RunOptions& options, double rate) {
+    vector<string> lines;
+    ifstream in(path);
+    string line;
+    while (getline(in, line)) {
+        if (line.compare(0, key.size() + 1, key + " ") != 0) lines.push_back(line);
+    }
+    in.close();
+
+    stringstream entry;
+    entry << key << " " << describeTuning(options) << " samples_per_sec=" << fixed
+          << setprecision(1) << rate;
+    lines.push_back(entry.str());
+
+    ofstream out(path);
+    if (!out.is_open()) {
+        cerr << "Error: Cannot write " << path << endl;
+        return false;
+    }
+    for (const string& l : lines) {
+        out << l << endl;
+    }
+    return true;
+}
+
+// Throughput of one candidate configuration on the synthetic sample stream
+double measureTuning(const RunOptions& candidate, const SharedWeights& shared,
+                     const vector<double>& base, long samples) {
+    SampleFeed feed;
+    feedInit(feed, base, samples);
+    vector<vector<double>> results;
+    long completed = 0;
+    double seconds = 0.0;
+    bool ok = dispatchSamples(candidate, shared, feed, candidate.replicas, results, completed, seconds);
+    return ok ? completed / max(seconds, 1e-9) : 0.0;
+}
+
+// Coordinate descent over batch size, transport, threads per layer and tile
+// sizes for the current topology; the best configuration is stored in the
+// profile so later runs with the same CPU and layer shapes pick it up
+int runAutotune(const RunOptions& options, const string& filename) {
+    ifstream input_file(filename);
+    if (!input_file.is_open()) {
+        cerr << "Error: Cannot open " << filename << endl;
+        return 1;
+    }
+    string line;
+    getline(input_file, line);
+    vector<double> base = parseLine(line);
+    input_file.close();
+
+    SharedWeights shared;
+    if (!loadSharedWeights(filename, base.size(), options.hidden_layers,
+                           options.neurons, shared)) {
+        return 1;
+    }
+    int total_layers = shared.layers.size();
+    int max_rows = 0, max_cols = 0;
+    for (const LayerShape& shape : shared.layers) {
+        max_rows = max(max_rows, shape.rows);
+        max_cols = max(max_cols, shape.cols);
+    }
+
+    RunOptions best = options;
+    best.replicas = max(1, options.replicas);
+    best.output_file.clear();
+    best.transport.clear();
+    best.tuning.threads = 1;
+    best.tuning.tile_rows = 0;
+    best.tuning.tile_cols = 0;
+    best.batch = 1;
+    finalizeTuning(best);
+
+    // Candidate values; threads per layer are capped by the cores each layer
+    // process gets when all replicas run at once
+    int ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int cores_per_layer = max(1, ncpu / (total_layers * best.replicas));
+    vector<int> threads, tile_rows, tile_cols, batches;
+    for (int t = 1; t <= cores_per_layer; t *= 2) threads.push_back(t);
+    tile_rows.push_back(0);
+    for (int t = 4; t < max_rows; t *= 4) tile_rows.push_back(t);
+    tile_cols.push_back(0);
+    for (int t = 64; t < max_cols; t *= 4) tile_cols.push_back(t);
+    for (int b = 1; b <= 64; b *= 4) batches.push_back(b);
+
+    string key = profileKey(shared);
+    cout << "========================================" << endl;
+    cout << "  AUTOTUNE" << endl;
+    cout << "  Key: " << key << endl;
+    cout << "  Replicas: " << best.replicas << ", window: " << best.window << " frames" << endl;
+    cout << "========================================" << endl;
+
+    // Size trials so that the baseline takes about a quarter of a second
+    long samples = options.samples > 0 ? options.samples : 0;
+    double best_rate = measureTuning(best, shared, base, 2000);
+    if (samples == 0) samples = max(2000L, min(500000L, (long)(best_rate * 0.25)));
+    best_rate = measureTuning(best, shared, base, samples);
+    cout << "Baseline: " << describeTuning(best) << "  " << fixed << setprecision(1)
+         << best_rate << " samples/sec (" << samples << " samples per trial)" << endl;
+
+    for (int round = 0; round < 2; round++) {
+        bool improved = false;
+        for (int param = 0; param < 5; param++) {
+            vector<int> values;
+            if (param == 0) values = batches;
+            if (param == 1) values = {0, 1};
+            if (param == 2) values = threads;
+            if (param == 3) values = tile_rows;
+            if (param == 4) values = tile_cols;
+
+            for (int value : values) {
+                RunOptions candidate = best;
+                if (param == 0) candidate.batch = value;
+                if (param == 1) candidate.tuning.unix_socket = (value == 1);
+                if (param == 2) candidate.tuning.threads = value;
+                if (param == 3) candidate.tuning.tile_rows = value;
+                if (param == 4) candidate.tuning.tile_cols = value;
+                if (describeTuning(candidate) == describeTuning(best)) continue;
+
+                double rate = measureTuning(candidate, shared, base, samples);
+                cout << "  " << describeTuning(candidate) << "  " << fixed << setprecision(1)
+                     << rate << " samples/sec" << endl;
+                // Require a 3% gain so measurement noise does not flip settings
+                if (rate > best_rate * 1.03) {
+                    best = candidate;
+                    best_rate = rate;
+                    improved = true;
+                }
+            }
+        }
+        if (!improved) break;
+    }
+
+    cout << "Best: " << describeTuning(best) << "  " << fixed << setprecision(1)
+         << best_rate << " samples/sec" << endl;
+    freeLarge(shared.base);
+    if (!saveProfile(options.profile_file, key, best, best_rate)) return 1;
+    cout << "Profile saved to " << options.profile_file << endl;
+    return 0;
+}
+
+// Run the sample stream with 1, 2, 4 ... N replicas and report throughput
+int runReplicaMode(RunOptions options, const string& filename) {
+    ifstream input_file(filename);
+    if (!input_file.is_open()) {
+        cerr << "Error: Cannot open " << filename << endl;
+        return 1;
+    }
+    string line;
+    getline(input_file, line);
+    vector<double> base = parseLine(line);
+    input_file.close();
+
+    // With --input-file the input width comes from the sample file
+    int input_dim = base.size();
+    if (!options.input_file.empty()) {
+        IngestStream probe;
+        if (!ingestOpen(probe, options.input_file)) return 1;
+        input_dim = probe.dim;
+        if (!ingestClose(probe)) return 1;
+        if (input_dim == 0) {
+            cerr << "Error: No samples in " << options.input_file << endl;
+            return 1;
+        }
+    }
+
+    SharedWeights shared;
+    if (!loadSharedWeights(filename, input_dim, options.hidden_layers,
+                           options.neurons, shared)) {
+        return 1;
+    }
+
+    applyProfile(options, shared);
+
+    long limit = sampleLimit(options);
+
+    cout << "========================================" << endl;
+    cout << "  REPLICA PIPELINE BENCHMARK" << endl;
+    cout << "  Layers: " << shared.layers.size() << ", neurons: " << options.neurons
+         << ", input width: " << input_dim << endl;
+    cout << "  Samples: " << (options.input_file.empty() ? "synthetic" : options.input_file);
+    if (limit > 0) cout << " (limit " << limit << ")";
+    cout << endl;
+    cout << "  Routing: " << (options.least_loaded ? "least-loaded" : "round-robin")
+         << ", window: " << options.window << endl;
+    cout << "  Tuning: " << describeTuning(options) << endl;
+    if (options.cache_entries > 0) {
+        cout << "  Output cache: " << options.cache_entries << " entries, "
+             << options.cache_shards << " shards" << endl;
+    }
+    cout << "========================================" << endl;
+    reportPageUsage("");
+
+    vector<int> counts;
+    for (int n = 1; n < options.replicas; n *= 2) {
+        counts.push_back(n);
+    }
+    counts.push_back(options.replicas);
+
+    int total_layers = shared.layers.size();
+    if (collect_counters) {
+        layer_counters = allocCounters(options.replicas * total_layers);
+    }
+
+    vector<vector<double>> results;
+    double baseline = 0.0;
+    long completed = 0;
+    // The synthetic stream has a known length; a sample file's length is
+    // taken from the first run and every later run must match it
+    long expected = options.input_file.empty() ? limit : -1;
+    bool run_failed = false;
+    for (int n : counts) {
+        if (layer_counters) {
+            memset(layer_counters, 0, options.replicas * total_layers * sizeof(LayerCounters));
+        }
+        SampleFeed feed;
+        feedInit(feed, base, limit);
+
+        // Each run starts cold so the replica counts stay comparable
+        OutputCache cache;
+        if (options.cache_entries > 0) {
+            cacheInit(cache, options.cache_entries, options.cache_shards);
+            feed.cache = &cache;
+            feed.weights = &shared;
+            feed.weights_file = filename;
+        }
+
+        IngestStream ingest;
+        ResultWriter writer;
+        if (!options.input_file.empty()) {
+            if (!ingestOpen(ingest, options.input_file)) return 1;
+            feed.ingest = &ingest;
+        }
+        if (!options.output_file.empty()) {
+            if (!writerOpen(writer, options.output_file, options.binary_output)) return 1;
+            feed.writer = &writer;
+        }
+
+        report_activation_pages = (n == counts.front());
+        double seconds = 0.0;
+        bool dispatched = dispatchSamples(options, shared, feed, n, results, completed, seconds);
+        report_activation_pages = false;
+        bool written = !feed.writer || writerClose(writer);
+        seconds = max(seconds, 1e-9);
+
+        double rate = completed / seconds;
+        if (baseline == 0.0) baseline = rate;
+        cout << "Replicas: " << setw(3) << n
+             << "  samples/sec: " << fixed << setprecision(1) << setw(12) << rate
+             << "  speedup: ";
+        if (baseline > 0.0) {
+            cout << setprecision(2) << rate / baseline << "x";
+        } else {
+            cout << "n/a";
+        }
+        if (feed.ingest) {
+            cout << "  ingest: " << (ingest.stream.reader.use_uring ? "io_uring" : "thread")
+                 << ", " << setprecision(1) << ingest.stream.bytes / seconds / 1e6 << " MB/s"
+                 << ", stalled " << setprecision(2) << 100.0 * ingest.wait_seconds / seconds << "%";
+        }
+        if (feed.writer) {
+            cout << "  writer stalled " << setprecision(2)
+                 << 100.0 * writer.wait_seconds / seconds << "%";
+        }
+        cout << endl;
+        bool read = !feed.ingest || ingestClose(ingest);
+        if (feed.cache) {
+            reportCache(cache);
+            cacheDestroy(cache);
+        }
+        if (!dispatched || !written || !read) {
+            run_failed = true;
+            break;
+        }
+
+        if (expected < 0) expected = completed;
+        if (completed != expected) {
+            cerr << "Error: Run with " << n << " replicas completed " << completed
+                 << " of " << expected << " samples" << endl;
+            run_failed = true;
+            break;
+        }
+    }
+
+    if (layer_counters) {
+        reportLayerCounters(layer_counters, counts.back(), total_layers, 0);
+        munmap(layer_counters, options.replicas * total_layers * sizeof(LayerCounters));
+        layer_counters = NULL;
+    }
+
+    if (run_failed) return 1;
+    saveResults(options, "REPLICA PIPELINE RESULTS", results);
+
+    freeLarge(shared.base);
+    return 0;
+}
+
+// ============================================================================
+// Distributed pipeline stages over TCP (--stage K / --distributed)
+// ============================================================================
+
+struct StageAddress {
+    string host;
+    int port;
+};
+
+// Stage placement read from the cluster config file
+struct ClusterConfig {
+    vector<StageAddress> stages;
+    StageAddress sink;
+    bool nodelay;
+    bool compress;
+    int batch;
+    size_t send_buffer;
+    int input_dim;
+};
+
+// Config format, one directive per line ('#' starts a comment):
+//   stage <layer> <host> <port>   placement of each layer (input layer is 0)
+//   sink <host> <port>            where the output stage sends results
+//   nodelay on|off                TCP_NODELAY on every stage connection
+//   compress on|off               deflate activation frames
+//   batch <samples>               samples per frame sent by the dispatcher
+//   send_buffer <bytes>           frames are coalesced up to this many bytes
+//   inputs <n>                    input width (default: line 1 of input.txt)
+bool loadClusterConfig(const string& path, ClusterConfig& config) {
+    ifstream file(path);
+    if (!file.is_open()) {
+        cerr << "Error: Cannot open " << path << endl;
+        return false;
+    }
+    config.sink.port = 0;
+    config.nodelay = true;
+    config.compress = false;
+    config.batch = 16;
+    config.send_buffer = 64 << 10;
+    config.input_dim = 0;
+
+    string line;
+    int line_num = 0;
+    while (getline(file, line)) {
+        line_num++;
+        line = line.substr(0, line.find('#'));
+        stringstream ss(line);
+        string key, value;
+        if (!(ss >> key)) continue;
+
+        bool ok = true;
+        if (key == "stage") {
+            int layer;
+            StageAddress address;
+            ok = (bool)(ss >> layer >> address.host >> address.port) && layer >= 0;
+            if (ok) {
+                if ((int)config.stages.size() <= layer) config.stages.resize(layer + 1);
+                config.stages[layer] = address;
+            }
+        } else if (key == "sink") {
+            ok = (bool)(ss >> config.sink.host >> config.sink.port);
+        } else if (key == "nodelay" || key == "compress") {
+            ok = (bool)(ss >> value);
+            (key == "nodelay" ? config.nodelay : config.compress) = (value == "on");
+        } else if (key == "batch") {
+            ok = (bool)(ss >> config.batch) && config.batch > 0 && config.batch <= MAX_FRAME_SAMPLES;
+        } else if (key == "send_buffer") {
+            ok = (bool)(ss >> config.send_buffer);
+        } else if (key == "inputs") {
+            ok = (bool)(ss >> config.input_dim);
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            cerr << "Error: " << path << ":" << line_num << ": bad line: " << line << endl;
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < config.stages.size(); i++) {
+        if (config.stages[i].host.empty()) {
+            cerr << "Error: " << path << ": no stage for layer " << i << endl;
+            return false;
+        }
+    }
+    if (config.sink.port == 0) {
+        cerr << "Error: " << path << ": missing sink" << endl;
+        return false;
+    }
+    return true;
+}
+
+bool resolveAddress(const StageAddress& address, struct sockaddr_in& addr) {
+    struct addrinfo hints;
+    struct addrinfo* info;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(address.host.c_str(), NULL, &hints, &info) != 0) {
+        cerr << "Error: Cannot resolve " << address.host << endl;
+        return false;
+    }
+    addr = *(struct sockaddr_in*)info->ai_addr;
+    addr.sin_port = htons(address.port);
+    freeaddrinfo(info);
+    return true;
+}
+
+void configureSocket(int fd, bool nodelay) {
+    int flag = nodelay ? 1 : 0;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    int buffer = 1 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+}
+
+int listenOn(const StageAddress& address) {
+    struct sockaddr_in addr;
+    if (!resolveAddress(address, addr)) return -1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        cerr << "Error: Cannot listen on " << address.host << ":" << address.port
+             << ": " << strerror(errno) << endl;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int acceptOne(int listen_fd, bool nodelay) {
+    int fd;
+    do {
+        fd = accept(listen_fd, NULL, NULL);
+    } while (fd < 0 && errno == EINTR);
+    if (fd >= 0) configureSocket(fd, nodelay);
+    return fd;
+}
+
+// Connect to the next stage, retrying while it starts up (up to 10 seconds)
+int connectTo(const StageAddress& address, bool nodelay) {
+    struct sockaddr_in addr;
+    if (!resolveAddress(address, addr)) return -1;
+    for (int attempt = 0; attempt < 200; attempt++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+            configureSocket(fd, nodelay);
+            return fd;
+        }
+        close(fd);
+        usleep(50000);
+    }
+    cerr << "Error: Cannot connect to " << address.host << ":" << address.port << endl;
+    return -1;
+}
+
+string linkStats(const FrameLink& link) {
+    stringstream ss;
+    ss << link.frames << " frames in " << link.sends << " sends, " << fixed << setprecision(2)
+       << link.raw_bytes / 1e6 << " MB raw, " << link.wire_bytes / 1e6 << " MB on the wire";
+    return ss.str();
+}
+
+// One layer served over TCP: accepts the upstream stage, connects to the
+// downstream stage (or the sink) and runs the usual layer loop on the sockets
+int runStageServer(RunOptions options, const ClusterConfig& config,
+                   int stage, const string& filename) {
+    SharedWeights shared;
+    if (!loadSharedWeights(filename, config.input_dim, options.hidden_layers,
+                           options.neurons, shared)) {
+        return 1;
+    }
+    applyProfile(options, shared);
+    if (stage < 0 || stage >= (int)shared.layers.size() ||
+        config.stages.size() != shared.layers.size()) {
+        cerr << "Error: Config places " << config.stages.size() << " stages but the model has "
+             << shared.layers.size() << " layers" << endl;
+        return 1;
+    }
+
+    int listen_fd = listenOn(config.stages[stage]);
+    if (listen_fd < 0) return 1;
+    int upstream = acceptOne(listen_fd, config.nodelay);
+    close(listen_fd);
+    bool is_output = stage == (int)shared.layers.size() - 1;
+    int downstream = connectTo(is_output ? config.sink : config.stages[stage + 1], config.nodelay);
+    if (upstream < 0 || downstream < 0) return 1;
+
+    FrameLink in, out;
+    linkInit(in, upstream, false, 0);
+    linkInit(out, downstream, config.compress, config.send_buffer);
+    LayerCounters counters;
+    memset(&counters, 0, sizeof(counters));
+    replicaLayerLoop(in, out, shared, stage, is_output, options.tuning,
+                     collect_counters ? &counters : NULL, false);
+
+    cout << "Stage " << stage << " (Process ID: " << getpid() << ") sent " + linkStats(out) << endl;
+    if (collect_counters) reportLayerCounters(&counters, 1, 1, stage);
+    freeLarge(shared.base);
+    return 0;
+}
+
+// Terminate and reap stage servers forked by --spawn-local when the
+// dispatcher gives up before they have a connection to serve
+void killStages(Replica& chain) {
+    for (pid_t pid : chain.pids) {
+        kill(pid, SIGTERM);
+    }
+    for (pid_t pid : chain.pids) {
+        waitpid(pid, NULL, 0);
+    }
+    chain.pids.clear();
+}
+
+bool isLocalHost(const string& host) {
+    return host == "127.0.0.1" || host == "localhost";
+}
+
+// Dispatcher for a distributed pipeline. With --spawn-local every stage placed
+// on localhost is started as a child process, which makes the whole transport
+// testable on one machine with one port per stage.
+int runDistributedMode(const RunOptions& options, const string& filename) {
+    ClusterConfig config;
+    if (!loadClusterConfig(options.config_file, config)) return 1;
+
+    ifstream input_file(filename);
+    string line;
+    getline(input_file, line);
+    input_file.close();
+    vector<double> base = parseLine(line);
+
+    if (config.input_dim == 0) {
+        config.input_dim = base.size();
+        if (!options.input_file.empty()) {
+            IngestStream probe;
+            if (!ingestOpen(probe, options.input_file)) return 1;
+            config.input_dim = probe.dim;
+            if (!ingestClose(probe)) return 1;
+        }
+    }
+    if (options.stage >= 0) {
+        return runStageServer(options, config, options.stage, filename);
+    }
+
+    RunOptions dispatch = options;
+    if (dispatch.batch == 0) dispatch.batch = config.batch;
+    dispatch.least_loaded = false;
+
+    cout << "========================================" << endl;
+    cout << "  DISTRIBUTED PIPELINE (" << config.stages.size() << " stages)" << endl;
+    for (size_t i = 0; i < config.stages.size(); i++) {
+        cout << "  Stage " << i << ": " << config.stages[i].host << ":" << config.stages[i].port << endl;
+    }
+    cout << "  Sink: " << config.sink.host << ":" << config.sink.port
+         << ", batch: " << dispatch.batch << ", nodelay: " << (config.nodelay ? "on" : "off")
+         << ", compress: " << (config.compress ? "on" : "off") << endl;
+    cout << "========================================" << endl;
+    cout.flush();
+
+    int sink_fd = listenOn(config.sink);
+    if (sink_fd < 0) return 1;
+
+    Replica chain;
+    chain.inflight = 0;
+    if (options.spawn_local) {
+        for (size_t i = 0; i < config.stages.size(); i++) {
+            if (!isLocalHost(config.stages[i].host)) continue;
+            pid_t pid = fork();
+            if (pid == 0) {
+                close(sink_fd);
+                exit(runStageServer(options, config, i, filename));
+            }
+            chain.pids.push_back(pid);
+        }
+    }
+
+    int first = connectTo(config.stages[0], config.nodelay);
+    int results_fd = first >= 0 ? acceptOne(sink_fd, config.nodelay) : -1;
+    close(sink_fd);
+    if (results_fd < 0) {
+        if (first >= 0) close(first);
+        killStages(chain);
+        return 1;
+    }
+    linkInit(chain.in, first, config.compress, config.send_buffer);
+    linkInit(chain.out, results_fd, false, 0);
+
+    SampleFeed feed;
+    feedInit(feed, base, sampleLimit(options));
+
+    IngestStream ingest;
+    ResultWriter writer;
+    bool opened = true;
+    if (!options.input_file.empty()) {
+        opened = ingestOpen(ingest, options.input_file);
+        if (opened) feed.ingest = &ingest;
+    }
+    if (opened && !options.output_file.empty()) {
+        opened = writerOpen(writer, options.output_file, options.binary_output);
+        if (opened) feed.writer = &writer;
+    }
+    if (!opened) {
+        if (feed.ingest) ingestClose(ingest);
+        close(first);
+        close(results_fd);
+        killStages(chain);
+        return 1;
+    }
+
+    vector<Replica> chains(1, chain);
+    vector<vector<double>> results;
+    long completed = 0;
+    double seconds = 0.0;
+    bool dispatched = runDispatcher(dispatch, feed, chains, config.input_dim, results, completed, seconds);
+    seconds = max(seconds, 1e-9);
+    bool written = !feed.writer || writerClose(writer);
+    bool read = !feed.ingest || ingestClose(ingest);
+
+    cout << "Distributed run: " << completed << " samples, " << fixed << setprecision(1)
+         << completed / seconds << " samples/sec" << endl;
+    cout << "Dispatcher sent " << linkStats(chains[0].in) << endl;
+    if (!dispatched || !written || !read) return 1;
+
+    saveResults(options, "DISTRIBUTED PIPELINE RESULTS", results);
+    return 0;
+}
+
+// ============================================================================
+// Layer graph (DAG) executor (--graph FILE)
+// ============================================================================
+
+enum NodeOp {
+    OP_INPUT,
+    OP_DENSE,
+    OP_ADD,
+    OP_CONCAT
+};
+
+// One node of the layer graph; its output tensor has width values
+struct GraphNode {
+    string name;
+    NodeOp op;
+    int width;
+    vector<int> inputs;
+    vector<int> consumers;
+    int layer;
+    int level;
+    int core;
+    int slot;
+};
+
+// Parsed and planned layer graph
+struct LayerGraph {
+    vector<GraphNode> nodes;
+    int input;
+    int output;
+    vector<size_t> slot_offsets;
+    vector<int> slot_widths;
+    size_t arena_values;
+    size_t naive_values;
+};
+
+int findNode(const LayerGraph& graph, const string& name) {
+    for (size_t i = 0; i < graph.nodes.size(); i++) {
+        if (graph.nodes[i].name == name) return i;
+    }
+    return -1;
+}
+
+// Graph format, one node per line, inputs must be defined first:
+//   input  <name> <width>
+//   dense  <name> <width> <input>       weighted sums, weights from input.txt
+//   add    <name> <input> <input>...    element-wise sum (residual connection)
+//   concat <name> <input> <input>...    concatenation of parallel branches
+//   output <name>                       node whose tensor is the result
+bool loadGraph(const string& path, LayerGraph& graph) {
+    ifstream file(path);
+    if (!file.is_open()) {
+        cerr << "Error: Cannot open " << path << endl;
+        return false;
+    }
+    graph.input = -1;
+    graph.output = -1;
+
+    string line;
+    int line_num = 0;
+    int dense_layers = 0;
+    while (getline(file, line)) {
+        line_num++;
+        line = line.substr(0, line.find('#'));
+        stringstream ss(line);
+        string op, name;
+        if (!(ss >> op)) continue;
+        if (!(ss >> name)) {
+            cerr << "Error: " << path << ":" << line_num << ": missing node name" << endl;
+            return false;
+        }
+        if (op == "output") {
+            graph.output = findNode(graph, name);
+            if (graph.output < 0) {
+                cerr << "Error: " << path << ":" << line_num << ": unknown node " << name << endl;
+                return false;
+            }
+            if (graph.output == graph.input) {
+                cerr << "Error: " << path << ":" << line_num << ": output cannot be the input node" << endl;
+                return false;
+            }
+            continue;
+        }
+        if (findNode(graph, name) >= 0) {
+            cerr << "Error: " << path << ":" << line_num << ": duplicate node " << name << endl;
+            return false;
+        }
+
+        GraphNode node;
+        node.name = name;
+        node.width = 0;
+        node.layer = -1;
+        node.level = 0;
+        node.core = 0;
+        node.slot = -1;
+        if (op == "input") {
+            node.op = OP_INPUT;
+        } else if (op == "dense") {
+            node.op = OP_DENSE;
+            node.layer = dense_layers++;
+        } else if (op == "add") {
+            node.op = OP_ADD;
+        } else if (op == "concat") {
+            node.op = OP_CONCAT;
+        } else {
+            cerr << "Error: " << path << ":" << line_num << ": unknown op " << op << endl;
+            return false;
+        }
+        if (node.op == OP_INPUT || node.op == OP_DENSE) {
+            if (!(ss >> node.width) || node.width <= 0) {
+                cerr << "Error: " << path << ":" << line_num << ": bad width" << endl;
+                return false;
+            }
+        }
+
+        string input;
+        while (ss >> input) {
+            int index = findNode(graph, input);
+            if (index < 0) {
+                cerr << "Error: " << path << ":" << line_num << ": unknown input " << input << endl;
+                return false;
+            }
+            node.inputs.push_back(index);
+        }
+
+        size_t expected = node.op == OP_INPUT ? 0 : node.op == OP_DENSE ? 1 : 2;
+        bool ok = node.op == OP_INPUT || node.op == OP_DENSE ? node.inputs.size() == expected
+                                                             : node.inputs.size() >= expected;
+        if (node.op == OP_INPUT && graph.input >= 0) ok = false;
+        for (int index : node.inputs) {
+            int width = graph.nodes[index].width;
+            if (node.op == OP_ADD) {
+                if (node.width != 0 && node.width != width) ok = false;
+                node.width = width;
+            } else if (node.op == OP_CONCAT) {
+                node.width += width;
+            }
+            node.level = max(node.level, graph.nodes[index].level + 1);
+        }
+        if (!ok) {
+            cerr << "Error: " << path << ":" << line_num << ": wrong inputs for " << op
+                 << " (one input node allowed, add needs equal widths)" << endl;
+            return false;
+        }
+        if (node.op == OP_INPUT) graph.input = graph.nodes.size();
+        graph.nodes.push_back(node);
+    }
+
+    if (graph.input < 0 || graph.output < 0) {
+        cerr << "Error: " << path << ": graph needs an input and an output node" << endl;
+        return false;
+    }
+    return true;
+}
+
+// Drop nodes the output does not depend on, then record consumers and
+// renumber the dense layers that are left, so skipped nodes take no weights
+void pruneGraph(LayerGraph& graph) {
+    vector<bool> needed(graph.nodes.size(), false);
+    needed[graph.output] = true;
+    for (int i = graph.nodes.size() - 1; i >= 0; i--) {
+        if (!needed[i]) continue;
+        for (int input : graph.nodes[i].inputs) {
+            needed[input] = true;
+        }
+    }
+
+    vector<int> remap(graph.nodes.size(), -1);
+    vector<GraphNode> kept;
+    for (size_t i = 0; i < graph.nodes.size(); i++) {
+        if (!needed[i]) {
+            cout << "Warning: Node " << graph.nodes[i].name << " does not reach the output, skipped" << endl;
+            continue;
+        }
+        remap[i] = kept.size();
+        kept.push_back(graph.nodes[i]);
+    }
+    int dense_layers = 0;
+    for (GraphNode& node : kept) {
+        for (int& input : node.inputs) {
+            input = remap[input];
+        }
+        node.consumers.clear();
+        if (node.op == OP_DENSE) node.layer = dense_layers++;
+    }
+    graph.input = remap[graph.input];
+    graph.output = remap[graph.output];
+    graph.nodes = kept;
+    for (size_t i = 0; i < graph.nodes.size(); i++) {
+        for (int input : graph.nodes[i].inputs) {
+            graph.nodes[input].consumers.push_back(i);
+        }
+    }
+}
+
+// Assign activation slots by liveness. A node may take over the slot of a
+// tensor once every consumer of that tensor is an ancestor of the node: the
+// node can only start after those consumers finished, so the reuse needs no
+// extra synchronization and independent branches still run concurrently.
+// Node processes are dealt out over the cores in level order, so nodes that
+// can run at the same time get separate cores while there are enough.
+void planGraph(LayerGraph& graph) {
+    int count = graph.nodes.size();
+    vector<vector<bool>> ancestor(count, vector<bool>(count, false));
+    for (int i = 0; i < count; i++) {
+        for (int input : graph.nodes[i].inputs) {
+            ancestor[i][input] = true;
+            for (int j = 0; j < count; j++) {
+                if (ancestor[input][j]) ancestor[i][j] = true;
+            }
+        }
+    }
+
+    vector<int> slot_owner;
+    graph.slot_widths.clear();
+    graph.naive_values = 0;
+    for (int i = 0; i < count; i++) {
+        GraphNode& node = graph.nodes[i];
+        graph.naive_values += node.width;
+
+        int best = -1;
+        for (size_t s = 0; s < slot_owner.size(); s++) {
+            const GraphNode& owner = graph.nodes[slot_owner[s]];
+            bool dead = slot_owner[s] != graph.output;
+            for (int consumer : owner.consumers) {
+                if (!ancestor[i][consumer]) dead = false;
+            }
+            if (!dead) continue;
+            // Prefer the smallest slot that fits, otherwise grow the largest
+            if (best < 0) {
+                best = s;
+            } else {
+                bool fits = graph.slot_widths[s] >= node.width;
+                bool best_fits = graph.slot_widths[best] >= node.width;
+                if ((fits && (!best_fits || graph.slot_widths[s] < graph.slot_widths[best])) ||
+                    (!fits && !best_fits && graph.slot_widths[s] > graph.slot_widths[best])) {
+                    best = s;
+                }
+            }
+        }
+        if (best < 0) {
+            best = slot_owner.size();
+            slot_owner.push_back(i);
+            graph.slot_widths.push_back(0);
+        }
+        slot_owner[best] = i;
+        graph.slot_widths[best] = max(graph.slot_widths[best], node.width);
+        node.slot = best;
+    }
+
+    graph.slot_offsets.clear();
+    graph.arena_values = 0;
+    for (int width : graph.slot_widths) {
+        graph.slot_offsets.push_back(graph.arena_values);
+        graph.arena_values += width;
+    }
+
+    int ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int max_level = 0;
+    for (const GraphNode& node : graph.nodes) {
+        max_level = max(max_level, node.level);
+    }
+    int next_core = 0;
+    for (int level = 0; level <= max_level; level++) {
+        for (int i = 0; i < count; i++) {
+            if (i == graph.input || graph.nodes[i].level != level) continue;
+            graph.nodes[i].core = next_core++ % ncpu;
+        }
+    }
+}
+
+// Node process: waits for a token on every input edge, computes its tensor
+// from the input slots into its own slot and passes the token on every
+// output edge. Exits when an input edge closes.
+void graphNodeLoop(const LayerGraph& graph, int index, double* arena,
+                   const SharedWeights& shared, const vector<int>& in_fds,
+                   const vector<int>& out_fds) {
+    const GraphNode& node = graph.nodes[index];
+    double* out = arena + graph.slot_offsets[node.slot];
+    long token = 0;
+
+    while (true) {
+        bool open = true;
+        for (int fd : in_fds) {
+            if (!readFull(fd, &token, sizeof(token))) open = false;
+        }
+        if (!open) break;
+
+        const GraphNode& first = graph.nodes[node.inputs[0]];
+        const double* x = arena + graph.slot_offsets[first.slot];
+        if (node.op == OP_DENSE) {
+            const LayerShape& shape = shared.layers[node.layer];
+            computeLayer(shared.base + shape.offset, shape.rows, shape.cols, x, out, 1);
+        } else if (node.op == OP_ADD) {
+            vector<double> sum(x, x + node.width);
+            for (size_t i = 1; i < node.inputs.size(); i++) {
+                const GraphNode& input = graph.nodes[node.inputs[i]];
+                const double* y = arena + graph.slot_offsets[input.slot];
+                for (int c = 0; c < node.width; c++) {
+                    sum[c] += y[c];
+                }
+            }
+            memcpy(out, sum.data(), node.width * sizeof(double));
+        } else {
+            vector<double> joined;
+            for (int input_index : node.inputs) {
+                const GraphNode& input = graph.nodes[input_index];
+                const double* y = arena + graph.slot_offsets[input.slot];
+                joined.insert(joined.end(), y, y + input.width);
+            }
+            memcpy(out, joined.data(), joined.size() * sizeof(double));
+        }
+
+        for (int fd : out_fds) {
+            writeFull(fd, &token, sizeof(token));
+        }
+    }
+
+    for (int fd : in_fds) close(fd);
+    for (int fd : out_fds) close(fd);
+}
+
+// Run samples through the layer graph: one process per node, one pipe per
+// edge, activations in a shared arena laid out by planGraph
+int runGraphMode(const RunOptions& options, const string& filename) {
+    LayerGraph graph;
+    if (!loadGraph(options.graph_file, graph)) return 1;
+    pruneGraph(graph);
+    planGraph(graph);
+
+    const GraphNode& input_node = graph.nodes[graph.input];
+    ifstream input_file(filename);
+    string line;
+    getline(input_file, line);
+    input_file.close();
+    vector<double> base = parseLine(line);
+    base.resize(input_node.width, 0.0);
+
+    // Dense layers take weight rows from input.txt in file order; pruneGraph
+    // numbered them in that order
+    SharedWeights shared;
+    for (const GraphNode& node : graph.nodes) {
+        if (node.op != OP_DENSE) continue;
+        LayerShape shape;
+        shape.rows = node.width;
+        shape.cols = graph.nodes[node.inputs[0]].width;
+        shape.offset = 0;
+        shared.layers.push_back(shape);
+    }
+    if (!mapSharedWeights(filename, shared)) return 1;
+
+    double* arena = (double*)allocLarge(graph.arena_values * sizeof(double), true, "activation arena");
+    if (!arena) {
+        cerr << "Error: Cannot map activation arena" << endl;
+        return 1;
+    }
+
+    cout << "========================================" << endl;
+    cout << "  LAYER GRAPH EXECUTOR (" << options.graph_file << ")" << endl;
+    cout << "========================================" << endl;
+    for (const GraphNode& node : graph.nodes) {
+        cout << "  " << left << setw(10) << node.name << right << " width " << setw(5) << node.width
+             << "  level " << node.level << "  core " << node.core << "  slot " << node.slot;
+        if (!node.inputs.empty()) {
+            cout << "  <-";
+            for (int input : node.inputs) cout << " " << graph.nodes[input].name;
+        }
+        cout << endl;
+    }
+    cout << "Activation memory: " << graph.arena_values * sizeof(double) << " bytes in "
+         << graph.slot_widths.size() << " slots (" << graph.naive_values * sizeof(double)
+         << " bytes without reuse)" << endl;
+    cout.flush();
+
+    // One pipe per edge; the parent feeds the input node's consumers and
+    // receives a token from the output node
+    int count = graph.nodes.size();
+    vector<vector<int>> in_fds(count), out_fds(count);
+    vector<int> parent_fds;
+    for (int i = 0; i < count; i++) {
+        for (int consumer : graph.nodes[i].consumers) {
+            int fds[2];
+            pipe(fds);
+            in_fds[consumer].push_back(fds[0]);
+            out_fds[i].push_back(fds[1]);
+        }
+    }
+    int result_pipe[2];
+    pipe(result_pipe);
+    out_fds[graph.output].push_back(result_pipe[1]);
+
+    vector<pid_t> pids;
+    for (int i = 0; i < count; i++) {
+        if (i == graph.input) continue;
+        pid_t pid = fork();
+        if (pid == 0) {
+            for (int j = 0; j < count; j++) {
+                for (int fd : in_fds[j]) if (j != i) close(fd);
+                for (int fd : out_fds[j]) if (j != i) close(fd);
+            }
+            close(result_pipe[0]);
+            pinToCores(graph.nodes[i].core, 1);
+            graphNodeLoop(graph, i, arena, shared, in_fds[i], out_fds[i]);
+            exit(0);
+        }
+        pids.push_back(pid);
+    }
+    for (int i = 0; i < count; i++) {
+        if (i == graph.input) continue;
+        for (int fd : in_fds[i]) close(fd);
+        for (int fd : out_fds[i]) close(fd);
+    }
+    close(result_pipe[1]);
+
+    SampleFeed feed;
+    feedInit(feed, base, sampleLimit(options));
+    IngestStream ingest;
+    ResultWriter writer;
+    if (!options.input_file.empty()) {
+        if (!ingestOpen(ingest, options.input_file)) return 1;
+        if (ingest.dim != input_node.width) {
+            cerr << "Error: " << options.input_file << " has " << ingest.dim
+                 << " columns, input node expects " << input_node.width << endl;
+            ingestClose(ingest);
+            return 1;
+        }
+        feed.ingest = &ingest;
+    }
+    if (!options.output_file.empty()) {
+        if (!writerOpen(writer, options.output_file, options.binary_output)) return 1;
+        feed.writer = &writer;
+    }
+
+    // Samples go through one at a time: the output node depends on every
+    // node, so its token means all slots of the sample may be reused
+    double* input_slot = arena + graph.slot_offsets[input_node.slot];
+    const GraphNode& output_node = graph.nodes[graph.output];
+    const double* output_slot = arena + graph.slot_offsets[output_node.slot];
+    vector<vector<double>> results;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long seq = 0;
+    while (feedNext(feed, seq, input_slot)) {
+        for (int fd : out_fds[graph.input]) {
+            writeFull(fd, &seq, sizeof(seq));
+        }
+        long token;
+        if (!readFull(result_pipe[0], &token, sizeof(token))) {
+            cerr << "Error: Graph node exited early" << endl;
+            break;
+        }
+
+        double sum = 0.0;
+        for (int c = 0; c < output_node.width; c++) {
+            sum += output_slot[c];
+        }
+        double result[2] = {(sum * sum + sum + 1) / 2.0, (sum * sum - sum) / 2.0};
+        if (feed.writer) {
+            writerPush(writer, result, 2);
+        } else {
+            results.push_back(vector<double>(result, result + 2));
+        }
+        seq++;
+    }
+    double seconds = max(elapsedSeconds(start), 1e-9);
+
+    for (int fd : out_fds[graph.input]) close(fd);
+    close(result_pipe[0]);
+    for (pid_t pid : pids) {
+        waitpid(pid, NULL, 0);
+    }
+    bool written = !feed.writer || writerClose(writer);
+    bool read = !feed.ingest || ingestClose(ingest);
+
+    cout << "Graph run: " << seq << " samples, " << fixed << setprecision(1)
+         << seq / seconds << " samples/sec" << endl;
+    if (!written || !read) {
+        freeLarge(arena);
+        freeLarge(shared.base);
+        return 1;
+    }
+    saveResults(options, "LAYER GRAPH RESULTS", results);
+
+    freeLarge(arena);
+    freeLarge(shared.base);
+    return 0;
+}
+
+// Compare one large layer with huge pages off and on. Single-sample layers
+// stream every weight row once per pass, so with 4 KB pages each pass walks
+// rows * cols * 8 / 4096 pages and misses the dTLB on most of them.
+int runHugePageBench(const RunOptions& options) {
+    vector<int> widths;
+    if (options.neurons > 0) {
+        widths.push_back(options.neurons);
+    } else {
+        widths.push_back(1024);
+        widths.push_back(2048);
+        widths.push_back(4096);
+    }
+    bool requested = use_hugepages;
+
+    cout << "========================================" << endl;
+    cout << "  HUGE PAGE LAYER BENCHMARK" << endl;
+    cout << "========================================" << endl;
+
+    for (int width : widths) {
+        double pass_ms[2] = {0.0, 0.0};
+        for (int on = 0; on < 2; on++) {
+            use_hugepages = (on == 1);
+            size_t count = (size_t)width * width;
+            double* weights = (double*)allocLarge(count * sizeof(double), false, "bench weights");
+            ActivationBuffer inputs = {NULL, 0, "bench input"};
+            ActivationBuffer outputs = {NULL, 0, "bench output"};
+            if (!weights || !reserveActivations(inputs, width) || !reserveActivations(outputs, width)) {
+                cerr << "Error: Cannot allocate a " << width << "x" << width << " layer" << endl;
+                return 1;
+            }
+            for (size_t i = 0; i < count; i++) {
+                weights[i] = 0.001 * (i % 1000);
+            }
+            for (int i = 0; i < width; i++) {
+                inputs.data[i] = 0.5 + 0.001 * i;
+            }
+
+            // Warm up once, then time passes for at least half a second
+            computeLayer(weights, width, width, inputs.data, outputs.data, 1);
+            PerfCounters perf;
+            if (collect_counters) perfOpen(perf, false);
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            long passes = 0;
+            double seconds;
+            do {
+                computeLayer(weights, width, width, inputs.data, outputs.data, 1);
+                passes++;
+                seconds = elapsedSeconds(start);
+            } while (seconds < 0.5);
+            pass_ms[on] = 1000.0 * seconds / passes;
+
+            cout << "\nLayer " << width << "x" << width << ", huge pages " << (on ? "on" : "off")
+                 << ": " << fixed << setprecision(3) << pass_ms[on] << " ms/pass, "
+                 << setprecision(2) << count * sizeof(double) / (pass_ms[on] / 1000.0) / 1e9
+                 << " GB/s of weights" << endl;
+            if (collect_counters) {
+                LayerCounters counters;
+                perfClose(perf, counters.values, counters.available);
+                cout << "dTLB misses per pass: ";
+                if (counters.available[COUNTER_DTLB_MISSES]) {
+                    cout << counters.values[COUNTER_DTLB_MISSES] / passes << endl;
+                } else {
+                    cout << "n/a" << endl;
+                }
+            }
+            reportPageUsage("");
+
+            freeLarge(weights);
+            releaseActivations(inputs);
+            releaseActivations(outputs);
+        }
+        cout << "Layer " << width << "x" << width << " speedup with huge pages: "
+             << setprecision(2) << pass_ms[0] / pass_ms[1] << "x" << endl;
+    }
+
+    use_hugepages = requested;
+    return 0;
+}
+
+// Parse --flag value pairs; returns false on an unknown flag
+bool parseOptions(int argc, char* argv[], RunOptions& options) {
+    options.hidden_layers = 0;
+    options.neurons = 0;
+    options.replicas = 0;
+    options.samples = 0;
+    options.window = 16;
+    options.least_loaded = false;
+    options.binary_output = false;
+    options.bench_hugepages = false;
+    options.batch = 0;
+    options.stage = -1;
+    options.distributed = false;
+    options.spawn_local = false;
+    options.tuning.threads = 0;
+    options.tuning.tile_rows = -1;
+    options.tuning.tile_cols = -1;
+    options.tuning.unix_socket = false;
+    options.autotune = false;
+    options.profile_file = DEFAULT_PROFILE;
+    options.cache_entries = 0;
+    options.cache_shards = 16;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        string value = (i + 1 < argc) ? argv[i + 1] : "";
+        if (arg == "--layers") {
+            options.hidden_layers = atoi(value.c_str()); i++;
+        } else if (arg == "--neurons") {
+            options.neurons = atoi(value.c_str()); i++;
+        } else if (arg == "--replicas") {
+            options.replicas = atoi(value.c_str()); i++;
+        } else if (arg == "--samples") {
+            options.samples = atol(value.c_str()); i++;
+        } else if (arg == "--window") {
+            options.window = max(1, atoi(value.c_str())); i++;
+        } else if (arg == "--route") {
+            options.least_loaded = (value == "least"); i++;
+        } else if (arg == "--input-file") {
+            options.input_file = value; i++;
+        } else if (arg == "--output-file") {
+            options.output_file = value; i++;
+        } else if (arg == "--output-format") {
+            options.binary_output = (value == "binary"); i++;
+        } else if (arg == "--hugepages") {
+            use_hugepages = (value != "off"); i++;
+        } else if (arg == "--threads") {
+            options.tuning.threads = max(1, atoi(value.c_str())); i++;
+        } else if (arg == "--tile-rows") {
+            options.tuning.tile_rows = max(0, atoi(value.c_str())); i++;
+        } else if (arg == "--tile-cols") {
+            options.tuning.tile_cols = max(0, atoi(value.c_str())); i++;
+        } else if (arg == "--transport") {
+            options.transport = value; i++;
+        } else if (arg == "--graph") {
+            options.graph_file = value; i++;
+        } else if (arg == "--autotune") {
+            options.autotune = true;
+        } else if (arg == "--profile") {
+            options.profile_file = value; i++;
+        } else if (arg == "--cache") {
+            options.cache_entries = max(0L, atol(value.c_str())); i++;
+        } else if (arg == "--cache-shards") {
+            options.cache_shards = max(1, atoi(value.c_str())); i++;
+        } else if (arg == "--perf") {
+            collect_counters = true;
+        } else if (arg == "--bench-hugepages") {
+            options.bench_hugepages = true;
+        } else if (arg == "--batch") {
+            options.batch = min(MAX_FRAME_SAMPLES, max(1, atoi(value.c_str()))); i++;
+        } else if (arg == "--config") {
+            options.config_file = value; i++;
+        } else if (arg == "--stage") {
+            options.stage = atoi(value.c_str()); i++;
+        } else if (arg == "--distributed") {
+            options.distributed = true;
+        } else if (arg == "--spawn-local") {
+            options.spawn_local = true;
+        } else {
+            cerr << "Error: Unknown option " << arg << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    string filename = "input.txt";
+    int num_hidden_layers;
+    int neurons_per_layer;
+
+    RunOptions options;
+    if (!parseOptions(argc, argv, options)) {
+        return 1;
+    }
+    bool replica_mode = options.replicas > 0 && !options.bench_hugepages &&
+                        options.graph_file.empty() && !options.autotune &&
+                        !options.distributed && options.stage < 0;
+    if (options.cache_entries > 0 && !replica_mode) {
+        cerr << "Error: --cache only works in replica mode (--replicas without "
+                "--graph, --autotune, --distributed or --stage)" << endl;
+        return 1;
+    }
+    if (options.bench_hugepages) {
+        return runHugePageBench(options);
+    }
+    if (!options.graph_file.empty()) {
+        return runGraphMode(options, filename);
+    }
+    if (options.autotune) {
+        if (options.hidden_layers <= 0 || options.neurons <= 0) {
+            cerr << "Error: --autotune needs --layers and --neurons" << endl;
+            return 1;
+        }
+        return runAutotune(options, filename);
+    }
+    if (options.distributed || options.stage >= 0) {
+        if (options.hidden_layers <= 0 || options.neurons <= 0 || options.config_file.empty()) {
+            cerr << "Error: --distributed and --stage need --config, --layers and --neurons" << endl;
+            return 1;
+        }
+        return runDistributedMode(options, filename);
+    }
+    if (options.replicas > 0) {
+        if (options.hidden_layers <= 0 || options.neurons <= 0) {
+            cerr << "Error: --replicas needs --layers and --neurons" << endl;
+            return 1;
+        }
+        return runReplicaMode(options, filename);
+    }
     
     cout << "========================================" << endl;
     cout << "  NEURAL NETWORK SIMULATION" << endl;